@@ -0,0 +1,316 @@
+#!/bin/bash
+
+#
+# Testing the algorithms and options of the hopping program on a
+# simulated path: a chain of network namespaces, each one a router
+# towards the next, so that the destinations along the chain are a
+# known number of hops away. Needs to be run as root, with the ip
+# command.
+#
+
+HOPS=14
+NSPREFIX=hopping-test-
+HOPPING="`pwd`/hopping"
+TMPOUTPUT=/tmp/hopping-netns-test.out
+FAILURES=0
+
+#
+# Set up the chain: namespace 0 runs the tests, and namespace j,
+# j = 1..HOPS, is reachable at 10.0.j.2, j hops away. Routers answer
+# TIME EXCEEDED without rate limits.
+#
+
+setup() {
+    for j in `seq 0 $HOPS`
+    do
+	ip netns add $NSPREFIX$j || exit 1
+	ip -n $NSPREFIX$j link set lo up
+	ip netns exec $NSPREFIX$j sysctl -qw net.ipv4.ip_forward=1 net.ipv4.icmp_ratelimit=0
+    done
+    for j in `seq 1 $HOPS`
+    do
+	ip link add hl$j netns $NSPREFIX$((j-1)) type veth peer name hr$j netns $NSPREFIX$j
+	ip -n $NSPREFIX$((j-1)) addr add 10.0.$j.1/24 dev hl$j
+	ip -n $NSPREFIX$((j-1)) link set hl$j up
+	ip -n $NSPREFIX$j addr add 10.0.$j.2/24 dev hr$j
+	ip -n $NSPREFIX$j link set hr$j up
+	ip -n $NSPREFIX$j route add default via 10.0.$j.1
+	if [ $j -gt 1 ]
+	then
+	    ip -n $NSPREFIX$j route add 10.0.1.0/24 via 10.0.$j.1
+	fi
+    done
+    for j in `seq 0 $((HOPS-1))`
+    do
+	ip -n $NSPREFIX$j route add 10.0.0.0/16 via 10.0.$((j+1)).2
+    done
+}
+
+cleanup() {
+    for j in `seq 0 $HOPS`
+    do
+	ip netns del $NSPREFIX$j 2> /dev/null
+    done
+}
+
+#
+# Run hopping with the given options towards a destination. The
+# results are left in the variables hopscount (the first field of the
+# result), reachability and probecount, and the whole first line in
+# resultline.
+#
+
+run() {
+    ip netns exec ${NSPREFIX}0 $HOPPING -interface hl1 -quiet -machine-readable "$@" > $TMPOUTPUT
+    resultline=`head -1 $TMPOUTPUT`
+    hopscount=`echo $resultline | cut -f1 -d:`
+    reachability=`echo $resultline | cut -f2 -d:`
+    probecount=`tail -1 $TMPOUTPUT`
+}
+
+#
+# Report a test as passed or failed
+#
+
+pass() {
+    echo "ok:   $1"
+}
+
+fail() {
+    echo "FAIL: $1"
+    FAILURES=$((FAILURES+1))
+}
+
+#
+# Check that a run towards the destination at a given hop count
+# finds it with at most the given number of probes
+#
+
+check() {
+    description=$1
+    count=$2
+    maxprobes=$3
+    shift 3
+    run "$@" 10.0.$count.2
+    if [ "x$hopscount" != "x$count" ]
+    then
+	fail "$description: hop count $hopscount vs. $count"
+    elif [ "x$probecount" = "x" ] || [ $probecount -gt $maxprobes ]
+    then
+	fail "$description: $probecount probes, expected at most $maxprobes"
+    else
+	pass "$description: $hopscount hops, $probecount probes"
+    fi
+}
+
+if [ `id -u` != 0 ]
+then
+    echo "Must be run as root -- exit"
+    exit 1
+fi
+
+cleanup
+trap cleanup EXIT
+setup
+
+#
+# The algorithms
+#
+
+for count in 1 5 12 $HOPS
+do
+    check "binarysearch" $count 8 -algorithm binarysearch
+    check "bayes" $count 8 -algorithm bayes
+    check "bayes, 4 parallel" $count 12 -algorithm bayes -parallel 4
+    check "optimal" $count 8 -algorithm optimal
+    check "optimal, 4 parallel" $count 12 -algorithm optimal -parallel 4
+done
+
+#
+# The table of the optimal algorithm is written to its cache file,
+# read back from it, and recomputed if the file is not a table
+#
+
+CACHEFILE=/tmp/hopping-netns-test-cache.txt
+rm -f $CACHEFILE
+
+#
+# Fingerprinting: all hosts of the chain send with an initial TTL of
+# 64, so the guess is right and the search takes three probes. With
+# an unusual initial TTL the guess is wrong, and the search goes on.
+#
+
+for count in 1 5 12 $HOPS
+do
+    check "fingerprint" $count 3 -fingerprint
+done
+ip netns exec $NSPREFIX$HOPS sysctl -qw net.ipv4.ip_default_ttl=100
+check "fingerprint, wrong guess" $HOPS 10 -fingerprint
+ip netns exec $NSPREFIX$HOPS sysctl -qw net.ipv4.ip_default_ttl=64
+
+#
+# Parallel binary search goes in rounds, each of which has at most
+# -parallel probes, all for different TTLs
+#
+
+for count in 1 5 12 $HOPS
+do
+    check "binarysearch, 2 parallel" $count 9 -parallel 2
+    check "binarysearch, 4 parallel" $count 12 -parallel 4
+    check "binarysearch, 8 parallel" $count 18 -parallel 8
+done
+run -parallel 4 -full-statistics 10.0.12.2
+rounds=`grep "rounds of parallel probes" $TMPOUTPUT | awk '{print $1}'`
+if [ "x$rounds" != "x" ] && [ $rounds -le 4 ]
+then
+    pass "binarysearch, 4 parallel: $rounds rounds"
+else
+    fail "binarysearch, 4 parallel: $rounds rounds, expected at most 4"
+fi
+
+#
+# Speculation sends extra probes for both outcomes, but no more than
+# the budget
+#
+
+for count in 1 5 12 $HOPS
+do
+    check "speculate 4" $count 12 -speculate 4
+    check "speculate 100" $count 20 -speculate 100
+done
+run -speculate 4 -full-statistics 10.0.12.2
+speculative=`grep "speculative probes sent" $TMPOUTPUT | awk '{print $1}'`
+if [ "x$speculative" != "x" ] && [ $speculative -le 4 ]
+then
+    pass "speculate 4: $speculative speculative probes"
+else
+    fail "speculate 4: $speculative speculative probes, expected at most 4"
+fi
+
+#
+# The latency algorithm, and the time that its model predicts
+#
+
+for count in 1 5 12 $HOPS
+do
+    check "latency" $count 8 -algorithm latency
+done
+run -algorithm latency -full-statistics 10.0.12.2
+predicted=`grep "expected time until the result" $TMPOUTPUT | awk '{print $1}'`
+if [ "x$predicted" != "x" ] && awk "BEGIN { exit !($predicted > 0) }"
+then
+    pass "latency: predicted time $predicted ms"
+else
+    fail "latency: no predicted time"
+fi
+
+#
+# Redundant copies: with the default stagger, the responses on this
+# fast path come before any copies are due, and without a stagger,
+# every probe goes out as all of its copies
+#
+
+for count in 1 5 12 $HOPS
+do
+    check "redundancy 3" $count 8 -redundancy 3
+    check "redundancy 3, no stagger" $count 24 -redundancy 3 -redundancy-stagger 0
+done
+run -redundancy 3 -redundancy-stagger 0 -full-statistics 10.0.12.2
+copies=`grep "redundant copies of probes sent" $TMPOUTPUT | awk '{print $1}'`
+sent=`grep "probes sent out" $TMPOUTPUT | awk '{print $1}'`
+if [ "x$copies" != "x" ] && [ "x$sent" != "x" ] && [ $((3*copies)) = $((2*sent)) ]
+then
+    pass "redundancy 3, no stagger: $copies copies of $sent probes"
+else
+    fail "redundancy 3, no stagger: $copies copies of $sent probes, expected two per probe"
+fi
+
+#
+# Deadlines: on a fast path they change nothing, and with -parallel 1
+# not even the probes. When the destination does not answer, the
+# search ends at the deadline with a range, and the most likely hop
+# count within it in a separate field at the end.
+#
+
+for count in 1 5 12 $HOPS
+do
+    run 10.0.$count.2
+    nodeadline=$probecount
+    check "deadline" $count $nodeadline -deadline 300
+    check "deadline, 4 parallel" $count 12 -deadline 300 -parallel 4
+done
+ip netns exec $NSPREFIX$HOPS sysctl -qw net.ipv4.icmp_echo_ignore_all=1
+start=`date +%s%N`
+run -deadline 300 10.0.$HOPS.2
+elapsed=$(((`date +%s%N` - start) / 1000000))
+low=`echo $hopscount | cut -f1 -d-`
+high=`echo $hopscount | cut -f2 -d-`
+estimate=`echo $resultline | cut -f3 -d:`
+if [ "x$low" = "x" ] || [ "x$high" != "x255" ] || [ $low -gt $HOPS ]
+then
+    fail "deadline, no answer: range $hopscount, expected one from at most $HOPS to 255"
+elif ! echo "$estimate" | grep -q "^[0-9]*/[0-9.]*$"
+then
+    fail "deadline, no answer: estimate '$estimate' in $resultline"
+elif [ $elapsed -gt 1000 ]
+then
+    fail "deadline, no answer: took $elapsed ms"
+else
+    pass "deadline, no answer: $resultline in $elapsed ms"
+fi
+ip netns exec $NSPREFIX$HOPS sysctl -qw net.ipv4.icmp_echo_ignore_all=0
+
+#
+# Tolerance: the result is a range of at most 2k+1 hop counts around
+# the hop count, found with no more probes than the exact one
+#
+
+for tolerance in 1 2 4
+do
+    for count in 1 5 12 $HOPS
+    do
+	run 10.0.$count.2
+	exact=$probecount
+	run -tolerance $tolerance 10.0.$count.2
+	low=`echo $hopscount | cut -f1 -d-`
+	high=`echo $hopscount | cut -f2 -d-`
+	description="tolerance $tolerance: $hopscount hops for $count, $probecount probes"
+	if [ "x$low" = "x" ] || [ "x$high" = "x" ] || [ $low -gt $count ] || [ $high -lt $count ]
+	then
+	    fail "$description, range does not contain the hop count"
+	elif [ $((high-low)) -gt $((2*tolerance)) ]
+	then
+	    fail "$description, range is too wide"
+	elif [ "x$probecount" = "x" ] || [ $probecount -gt $exact ]
+	then
+	    fail "$description, expected at most $exact probes"
+	else
+	    pass "$description"
+	fi
+    done
+done
+check "optimal, new cache" 12 8 -algorithm optimal -optimal-cache $CACHEFILE
+if head -1 $CACHEFILE | grep -q "hopping optimal search policy"
+then
+    pass "optimal cache written"
+else
+    fail "optimal cache not written"
+fi
+check "optimal, cached" 12 8 -algorithm optimal -optimal-cache $CACHEFILE
+echo "garbage" > $CACHEFILE
+check "optimal, invalid cache" 12 8 -algorithm optimal -optimal-cache $CACHEFILE
+if head -1 $CACHEFILE | grep -q "hopping optimal search policy"
+then
+    pass "optimal cache rewritten"
+else
+    fail "optimal cache not rewritten"
+fi
+rm -f $CACHEFILE
+
+echo ''
+if [ $FAILURES -gt 0 ]
+then
+    echo "**** $FAILURES tests failed"
+    exit 1
+fi
+echo '**** All tests passed'
@@ -11,11 +11,13 @@
 //            (working on open sourcing this)
 //
 
+#define _GNU_SOURCE
 #include <time.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <signal.h>
 #include <string.h>
 #include <sys/time.h>
@@ -32,6 +34,15 @@
 #include <unistd.h>
 #include <ifaddrs.h>
 #include <errno.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 
 //
@@ -40,6 +51,7 @@
 
 #define HOPPING_IP4_HDRLEN			20
 #define HOPPING_ICMP4_HDRLEN			 8
+#define HOPPING_PROBE_HDRLEN			(HOPPING_IP4_HDRLEN + HOPPING_ICMP4_HDRLEN)
 #define HOPPING_ICMP_ECHOREPLY			 0
 #define HOPPING_ICMP_DEST_UNREACH		 3
 #define HOPPING_ICMP_REDIRECT			 5
@@ -51,13 +63,16 @@
 // Types -------------------------------------------------------------
 //
 
-typedef uint16_t hopping_idtype;
+typedef uint32_t hopping_idtype;
 
 enum hopping_algorithms {
   hopping_algorithms_random,
   hopping_algorithms_sequential,
   hopping_algorithms_reversesequential,
-  hopping_algorithms_binarysearch
+  hopping_algorithms_binarysearch,
+  hopping_algorithms_bayes,
+  hopping_algorithms_optimal,
+  hopping_algorithms_latency
 };
 
 enum hopping_responseType {
@@ -67,47 +82,169 @@ enum hopping_responseType {
   hopping_responseType_redirect,
   hopping_responseType_timeExceeded,
   hopping_responseType_retransmissionConsidered,
-  hopping_responseType_noResponse
+  hopping_responseType_noResponse,
+  hopping_responseType_cancelled
 };
 
+enum hopping_fingerprintState {
+  hopping_fingerprintState_start,
+  hopping_fingerprintState_opening,
+  hopping_fingerprintState_confirming,
+  hopping_fingerprintState_checking,
+  hopping_fingerprintState_done
+};
+
+//
+// Jacobson/Karels round-trip time estimator. The TTLs are grouped in
+// bands of HOPPING_RTT_BAND_WIDTH, each with its own estimator, as
+// routers at different distances and the destination itself answer
+// with different delays.
+//
+
+#define HOPPING_RTT_BAND_WIDTH			 8
+#define HOPPING_RTT_BANDS			(256 / HOPPING_RTT_BAND_WIDTH)
+
+struct hopping_rttestimator {
+  unsigned int samples;
+  unsigned long srttUSecs;
+  unsigned long rttvarUSecs;
+};
+
+//
+// What has been learned during the run about the two outcomes of a
+// probe, an ECHO REPLY from the destination or a TIME EXCEEDED from a
+// router: how likely a probe is to get a response, and how long the
+// response takes.
+//
+
+struct hopping_latencymodel {
+  double echoProbability;
+  double echoDelayUSecs;
+  double timeExceededProbability;
+  double timeExceededDelayUSecs;
+};
+
+struct hopping_destination {
+  const char* name;
+  struct sockaddr_in address;
+  unsigned int bucket;
+  unsigned int probesSent;
+  unsigned char currentTtl;
+  unsigned char hopsMinInclusive;
+  unsigned char hopsMaxInclusive;
+  struct timeval startTime;
+  struct timeval deadline;
+  struct timeval nextProbeTime;
+  int probeTemplateBuilt;
+  char probeTemplate[HOPPING_PROBE_HDRLEN];
+  struct hopping_probe* probeList;
+  struct hopping_probe* probeListTail;
+  uint64_t ttlsProbed[4];
+  uint64_t roundPlan[4];
+  unsigned int rounds;
+  unsigned int speculativeProbes;
+  unsigned int redundantProbes;
+  unsigned int redundancyPending;
+  struct timeval redundancyTime;
+  struct hopping_probe* ttlProbes[256];
+  double posterior[256];
+  unsigned char fingerprintState;	// enum hopping_fingerprintState
+  unsigned char fingerprintGuess;
+  struct hopping_rttestimator rtt;
+  struct hopping_rttestimator rttBands[HOPPING_RTT_BANDS];
+  unsigned int nProbes;
+  unsigned int nResponses;
+  unsigned int nReplyResponses;
+  unsigned int nTimeExceededResponses;
+  unsigned int nUnreachableResponses;
+  unsigned int nWaitingResponses;
+  struct hopping_destination* next;
+};
+
+//
+// The probe table is split in two parallel arrays indexed by the
+// probe slot. struct hopping_probe holds the state that the timer,
+// response matching and search code look at for every probe, and is
+// kept small so that scans over many in-flight probes touch as few
+// cache lines as possible. struct hopping_probestats holds the
+// per-probe timing and statistics, which are only needed when a
+// probe is sent, gets a response, or is reported.
+//
+
 struct hopping_probe {
-  int used;
+  uint8_t used;
+  uint8_t responded;
+  uint8_t hops;
+  uint8_t responseType;		// enum hopping_responseType
+  uint8_t timerArmed;
+  uint8_t speculative;
+  uint8_t redundant;
+  uint16_t timerSlot;
   hopping_idtype id;
-  unsigned char hops;
-  struct hopping_probe* previousTransmission;
+  uint32_t deadline;		// timer ticks since timerEpoch
+  unsigned int tries;
+  struct hopping_destination* destination;
   struct hopping_probe* nextRetransmission;
+  struct hopping_probe* timerNext;
+  struct hopping_probe* timerPrev;
+};
+
+struct hopping_probestats {
+  struct hopping_probe* destinationNext;
+  struct hopping_probe* previousTransmission;
   struct hopping_probe* newProbeSentInsteadOfRetransmission;
   unsigned int probeLength;
   struct timeval sentTime;
-  struct timeval initialTimeout;
-  int responded;
+  unsigned long timeoutUSecs;
+  int kernelSentTime;
+  uint32_t transmitKey;
   unsigned int duplicateResponses;
+  struct hopping_probe* redundantNext;
+  unsigned int redundantCopiesLeft;
   unsigned int responseLength;
   struct timeval responseTime;
+  int kernelResponseTime;
   unsigned long delayUSecs;
-  enum hopping_responseType responseType;
 };
 
-typedef int (*hopping_ttl_test_function)(unsigned char ttl);
+typedef uint64_t (*hopping_checksumsum_function)(const unsigned char* data,
+						  int length);
 
 //
 // Constants ------------------------------------------------------------
 //
 
 #define hopping_algorithms_string	\
-        "random, sequential, reversesequential, or binarysearch"
-
-#define HOPPING_MAX_PROBES			        256
-#define HOPPING_POLL_FREQUENCY				5
-#define HOPPING_POLL_SLEEP_US				((1000 * 1000) /              \
-                                       			  HOPPING_POLL_FREQUENCY)
+        "random, sequential, reversesequential, binarysearch, bayes, optimal, or latency"
+
+#define HOPPING_MIN_PROBES			        256
+#define HOPPING_SLOT_HIGH_BITS				4
+#define HOPPING_MAX_PROBES			        (1 << (16 + HOPPING_SLOT_HIGH_BITS))
+#define HOPPING_GENERATION_MASK				((1 << (16 - HOPPING_SLOT_HIGH_BITS)) - 1)
+#define HOPPING_MAX_EVENTS				4
+#define HOPPING_RECEIVE_BATCH				64
+#define HOPPING_RECEIVE_BUFFER_MIN			2048
+#define HOPPING_RECEIVE_BUFFER_SLACK			128
+#define HOPPING_SEND_BATCH				64
+#define HOPPING_RECEIVE_CONTROL_SIZE			128
+#define HOPPING_TRANSMIT_KEYS				4096
+#define HOPPING_TIMER_WHEEL_GRANULARITY_US		1000
+#define HOPPING_TIMER_WHEEL_SLOTS			32768
+#define HOPPING_TIMER_WHEEL_WORDS			(HOPPING_TIMER_WHEEL_SLOTS / 64)
 #define HOPPING_INITIAL_RETRANSMISSION_TIMEOUT_US	(500 * 1000)
+#define HOPPING_MIN_RETRANSMISSION_TIMEOUT_US		(50 * 1000)
 #define HOPPING_MAX_RETRANSMISSION_TIMEOUT_US		(20 * 1000 * 1000)
 #define HOPPING_RETRANSMISSION_BACKOFF_FACTOR		2
 #define HOPPING_TYPICAL_INTERNET_HOP_COUNT		5
 #define HOPPING_TYPICAL_INTERNET_MIN_HOP_COUNT		3
 #define HOPPING_TYPICAL_INTERNET_MAX_HOP_COUNT		22
 #define HOPPING_N_TYPICAL_HOP_COUNT_TRIES		4
+#define HOPPING_DEFAULT_DESTINATION			"www.google.com"
+#define HOPPING_DEFAULT_CONCURRENT_DESTINATIONS		100
+#define HOPPING_PROBE_PAYLOAD				"archtester"
+#define HOPPING_MAX_TARGET_LINE				1024
+#define HOPPING_MAX_REDUNDANCY				16
+#define HOPPING_DEFAULT_REDUNDANCY_STAGGER_US		(10 * 1000)
 
 //
 // Table of hop count likely distributions
@@ -120,6 +257,18 @@ typedef int (*hopping_ttl_test_function)(unsigned char ttl);
 #define HOPPING_DISTRIBUTION_SEMI_B_LIKELY		 3.000000 /* % */
 #define HOPPING_DISTRIBUTION_SEMI_C_LIKELY		 5.000000 /* % */
 #define HOPPING_DISTRIBUTION_MOST_LIKELY		 9.910000 /* % */
+#define HOPPING_DISTRIBUTION_MIN_LIKELY			 0.001000 /* % */
+#define HOPPING_DEFAULT_DISTRIBUTION_DECAY		 0.99
+#define HOPPING_MAX_DISTRIBUTION_LINE			 128
+#define HOPPING_DEFAULT_BAYES_CONFIDENCE		 0.99
+#define HOPPING_DEFAULT_BAYES_SILENCE			 0.10
+#define HOPPING_BAYES_LOSS				 0.02
+#define HOPPING_BAYES_ERROR				 0.0001
+#define HOPPING_OPTIMAL_PROBE_COST			 0.001
+#define HOPPING_MAX_OPTIMAL_LINE			 1024
+#define HOPPING_LATENCY_PRIOR_PROBABILITY		 0.9
+#define HOPPING_LATENCY_PRIOR_WEIGHT			 2.0
+#define HOPPING_LATENCY_DEFAULT_DELAY_US		(100 * 1000)
 
 // Sums below need to make up 100.00
 
@@ -382,12 +531,32 @@ float hopsprobabilitydistribution[256] = {
   /* 255 */ HOPPING_DISTRIBUTION_VERY_UNLIKELY
 };
 
+//
+// Cumulative distribution of the above, as fractions: entry i is
+// the probability that the hop count is less than i. Computed by
+// hopping_computecumulativedistribution().
+//
+
+static double hopscumulativedistribution[257];
+
+//
+// The optimal search policy for -algorithm optimal: for every range
+// lo..hi of possible hop counts, the TTLs to probe next, up to
+// optimalPolicyWidth of them. Entry (lo * 256 + hi) *
+// optimalPolicyWidth is the first TTL; unused entries are 0.
+//
+
+static unsigned char* optimalPolicy = 0;
+static unsigned int optimalPolicyWidth = 0;
+
 //
 // Configuration variables
 // 
 
-const char* testDestination = "www.google.com";
-struct sockaddr_in testDestinationAddress;
+const char* testDestination = 0;
+const char* targetsFile = 0;
+const char* distributionFile = 0;
+const char* optimalCacheFile = 0;
 const char* interface = "eth0";
 static int debug = 0;
 static int progress = 1;
@@ -400,48 +569,103 @@ static int machineReadable = 0;
 static unsigned int startTtl = 1;
 static unsigned int maxTtl = 255;
 static unsigned int maxProbes = 50;
+static unsigned int concurrentDestinations = HOPPING_DEFAULT_CONCURRENT_DESTINATIONS;
 static unsigned int maxWait = 30;
+static unsigned int deadlineMs = 0;
+static unsigned int tolerance = 0;
 static unsigned int maxTries = 3;
 static unsigned int parallel = 1;
 static unsigned int probePacing = 0;
 static int preferRetransmissionsOverNewProbes = 0;
 static unsigned int likelyCandidates = 1;
 static int probabilisticDistribution = 1;
+static int fingerprint = 0;
+static unsigned int speculationBudget = 0;
+static unsigned int redundancy = 1;
+static unsigned int redundancyStagger = HOPPING_DEFAULT_REDUNDANCY_STAGGER_US;
+static double distributionDecay = HOPPING_DEFAULT_DISTRIBUTION_DECAY;
+static double bayesConfidence = HOPPING_DEFAULT_BAYES_CONFIDENCE;
+static double bayesSilence = HOPPING_DEFAULT_BAYES_SILENCE;
 static unsigned int icmpDataLength = 0;
 static enum hopping_algorithms algorithm = hopping_algorithms_binarysearch;
 static int readjust = 1;
+static int kernelTimestamps = 1;
 
 //
 // Other Variables --------------------------------------------------------
 //
 
-static unsigned int bucket = 0;
 static int interrupt = 0;
-static struct hopping_probe probes[HOPPING_MAX_PROBES];
-static unsigned int probesSent = 0;
-static unsigned char currentTtl = 1;
+static struct hopping_probe* probes = 0;
+static struct hopping_probestats* probeStats = 0;
+static uint16_t* probeGenerations = 0;
+static hopping_idtype* freeSlots = 0;
+static unsigned int nFreeSlots = 0;
+static unsigned int probeTableSize = 0;
+static struct hopping_probe* timerWheel[HOPPING_TIMER_WHEEL_SLOTS];
+static uint64_t timerWheelOccupied[HOPPING_TIMER_WHEEL_WORDS];
+static unsigned long long timerWheelCursor = 0;
+static unsigned long long timerEpoch = 0;
+static struct mmsghdr receiveMessages[HOPPING_RECEIVE_BATCH];
+static struct iovec receiveIovecs[HOPPING_RECEIVE_BATCH];
+static char* receiveBuffers = 0;
+static unsigned int receiveBufferSize = 0;
+static struct mmsghdr sendMessages[HOPPING_SEND_BATCH];
+static struct iovec sendIovecs[HOPPING_SEND_BATCH][2];
+static struct sockaddr_in sendAddresses[HOPPING_SEND_BATCH];
+static char sendHeaders[HOPPING_SEND_BATCH][HOPPING_PROBE_HDRLEN];
+static char* probePayload = 0;
+static unsigned int nPendingSends = 0;
+static hopping_idtype sendIds[HOPPING_SEND_BATCH];
+static char receiveControl[HOPPING_RECEIVE_BATCH][HOPPING_RECEIVE_CONTROL_SIZE];
+static struct mmsghdr timestampMessages[HOPPING_RECEIVE_BATCH];
+static char timestampControl[HOPPING_RECEIVE_BATCH][HOPPING_RECEIVE_CONTROL_SIZE];
+static hopping_idtype transmitKeys[HOPPING_TRANSMIT_KEYS];
+static uint32_t transmitKeyCounter = 0;
+static unsigned int probeSlotsReserved = 0;
+static struct hopping_destination* activeDestinations = 0;
+static unsigned int nActiveDestinations = 0;
+static FILE* targetsInput = 0;
 static int seenprogressreport = 0;
 static int lastprogressreportwassentpacket = 0;
-static unsigned char hopsMinInclusive = 1;
-static unsigned char hopsMaxInclusive = 255;
-static struct timeval startTime;
 
 //
 // Prototype definitions of functions ------------------------------------
 //
 
 static unsigned int
-hopping_waitingforresponses(void);
+hopping_waitingforresponses(struct hopping_destination* destination);
 static void
-hopping_reportBriefConclusion(void);
+hopping_reportBriefConclusion(struct hopping_destination* destination);
 static struct hopping_probe*
 hopping_sendprobe(int sd,
-		  struct sockaddr_in* destinationAddress,
+		  struct hopping_destination* destination,
 		  struct sockaddr_in* sourceAddress,
 		  int inbucket);
+static struct hopping_probe*
+hopping_sendprobewithttl(int sd,
+			 struct hopping_destination* destination,
+			 struct sockaddr_in* sourceAddress,
+			 unsigned char ttl);
+static void
+hopping_speculate(int sd,
+		  struct hopping_destination* destination,
+		  struct sockaddr_in* sourceAddress,
+		  struct hopping_probe* parent);
+static void
+hopping_redundancy_schedule(struct hopping_destination* destination,
+			    struct hopping_probe* probe);
+static int
+hopping_deadline_passed(struct hopping_destination* destination);
+static int
+hopping_searchdone(struct hopping_destination* destination);
+static struct hopping_probe*
+hopping_redundancy_answered(struct hopping_probe* probe);
+static void
+hopping_redundancy_satisfy(struct hopping_probe* probe);
 static void
 hopping_sendprobeaux(int sd,
-		     struct sockaddr_in* destinationAddress,
+		     struct hopping_destination* destination,
 		     struct sockaddr_in* sourceAddress,
 		     unsigned int expectedLen,
 		     struct hopping_probe* probe);
@@ -450,36 +674,86 @@ hopping_getcurrenttime(struct timeval* result);
 static void
 fatalf(const char* format, ...);
 static unsigned int
-hopping_responses();
+hopping_responses(struct hopping_destination* destination);
 static unsigned char
-hopping_bestbinarysearchvalue(unsigned char from,
+hopping_bestbinarysearchvalue(struct hopping_destination* destination,
+			      unsigned char from,
 			      unsigned char to,
-			      hopping_ttl_test_function suitableTestFunction,
 			      unsigned int numberOfTests);
 static unsigned char
-hopping_bestinitialotherguess(unsigned char from,
+hopping_bestinitialotherguess(struct hopping_destination* destination,
+			      unsigned char from,
 			      unsigned char to,
-			      hopping_ttl_test_function suitableTestFunction,
 			      unsigned int numberOfTests);
+static unsigned char
+hopping_searchquantile(struct hopping_destination* destination,
+		       unsigned char from,
+		       unsigned char to,
+		       unsigned int part,
+		       unsigned int parts);
+static void
+hopping_bucket_initialize(struct hopping_destination* destination,
+			  unsigned int tasks);
+static int
+hopping_bucket_cantakeontask(struct hopping_destination* destination);
+static void
+hopping_bucket_taketask(struct hopping_destination* destination);
 static void
-hopping_bucket_initialize(unsigned int tasks);
+hopping_bucket_releasetask(struct hopping_destination* destination);
+static unsigned int
+hopping_deadline_roundsize(struct hopping_destination* destination);
 static int
-hopping_bucket_cantakeontask();
+hopping_estimate(struct hopping_destination* destination,
+		 unsigned char* hops,
+		 double* confidence);
+static void
+hopping_learndistribution(struct hopping_destination* destination);
+static const char*
+hopping_responseTypeToString(enum hopping_responseType rt);
+static double
+hopping_distributionmass(unsigned char from,
+			 unsigned char to);
+static void
+hopping_reportprogress_received(struct hopping_destination* destination,
+				enum hopping_responseType responseType,
+				hopping_idtype id,
+				unsigned char ttl);
+static void
+hopping_bayes_initialize(struct hopping_destination* destination);
 static void
-hopping_bucket_taketask(void);
+hopping_fingerprint_observe(struct hopping_destination* destination,
+			    enum hopping_responseType type,
+			    unsigned char responseTtl);
 static void
-hopping_bucket_releasetask(void);
+hopping_bayes_observe(struct hopping_destination* destination,
+		      unsigned char ttl,
+		      enum hopping_responseType type,
+		      unsigned char responseTtl,
+		      unsigned int tries);
 static unsigned char
 hopping_selectfromdistribution(double probabilityPosition,
-			       unsigned char* choices,
-			       unsigned int nChoices);
+			       unsigned char from,
+			       unsigned char to,
+			       const uint64_t* excluded);
 static void
 hopping_reportBriefProbeStatusAux(struct hopping_probe* prob);
 static unsigned long long
 hopping_timediffinusecs(struct timeval* later,
 			struct timeval* earlier);
 static void
-hopping_reportBriefProbeStatus(void);
+hopping_reportBriefProbeStatus(struct hopping_destination* destination);
+static void
+hopping_reportConclusion(struct hopping_destination* destination);
+static void
+hopping_reportConclusionAux(struct hopping_destination* destination);
+static void
+hopping_reportConclusionEstimate(struct hopping_destination* destination);
+static void
+hopping_reportStats(struct hopping_destination* destination);
+static void
+hopping_reportStatsFull(struct hopping_destination* destination);
+static unsigned int
+hopping_count_probes_sent(struct hopping_destination* destination);
 
 //
 // Some helper macros ----------------------------------------------------
@@ -582,6 +856,9 @@ hopping_algorithm2name(enum hopping_algorithms algo) {
   case hopping_algorithms_sequential: return("sequential");
   case hopping_algorithms_reversesequential: return("reversesequential");
   case hopping_algorithms_binarysearch: return("binarysearch");
+  case hopping_algorithms_bayes: return("bayes");
+  case hopping_algorithms_optimal: return("optimal");
+  case hopping_algorithms_latency: return("latency");
   default:
     fatalf("invalid internal algorithm setting");
     return("");
@@ -596,7 +873,7 @@ hopping_algorithm2name(enum hopping_algorithms algo) {
 static void
 hopping_fillwithstring(char* buffer,
 		       const char* string,
-		       unsigned char bufferSize) {
+		       unsigned int bufferSize) {
   
   const char* stringPointer = string;
 
@@ -670,8 +947,8 @@ hopping_timediffinusecs(struct timeval* later,
     }
     return(later->tv_usec - earlier->tv_usec);
   } else {
-    unsigned long long result = 1000 * 1000 * (later->tv_sec - earlier->tv_sec);
-    result += (1000*1000) - earlier->tv_usec;
+    unsigned long long result = 1000 * 1000 * (unsigned long long)(later->tv_sec - earlier->tv_sec);
+    result -= earlier->tv_usec;
     result += later->tv_usec;
     return(result);
   }
@@ -684,7 +961,7 @@ hopping_timeadd(struct timeval* base,
   unsigned long long totalUs = base->tv_usec + us;
   hopping_assert(result != 0);
   result->tv_sec = base->tv_sec + totalUs / (1000 * 1000);
-  result->tv_usec = base->tv_usec + totalUs % (1000 * 1000);
+  result->tv_usec = totalUs % (1000 * 1000);
 }
 
 //
@@ -698,252 +975,807 @@ hopping_addrtostring(struct in_addr* addr) {
 }
 
 //
-// Get current time
+// Get current time. All times in the program are on the monotonic
+// clock, so that changes to the system time do not affect probe
+// timings.
 //
 
 static void
 hopping_getcurrenttime(struct timeval* result) {
+  struct timespec now;
   hopping_assert(result != 0);
-  if (gettimeofday(result, 0) < 0) {
-    fatalp("cannot determine current time via gettimeofday");
+  if (clock_gettime(CLOCK_MONOTONIC, &now) < 0) {
+    fatalp("cannot determine current time via clock_gettime");
   }
+  result->tv_sec = now.tv_sec;
+  result->tv_usec = now.tv_nsec / 1000;
 }
 
 //
-// Add a new probe entry
+// Convert a timestamp from the kernel, which is on the system
+// (realtime) clock, to the monotonic clock
 //
 
-static struct hopping_probe*
-hopping_newprobe(hopping_idtype id,
-		 unsigned char hops,
-		 unsigned int probeLength,
-		 struct hopping_probe* previousProbe) {
-  
-  struct hopping_probe* probe = &probes[id];
-  hopping_assert(id < HOPPING_MAX_PROBES);
-  if (probe->used) {
-    fatalf("cannot allocate a new probe for id %u", (unsigned int)id);
-    return(0);
-  }
-
-  memset(probe,0,sizeof(*probe));
-  
-  probe->used = 1;
-  probe->id = id;
-  probe->hops = hops;
-  probe->probeLength = probeLength;
-  probe->responded = 0;
-  probe->duplicateResponses = 0;
-  probe->responseType = hopping_responseType_stillWaiting;
+static void
+hopping_kerneltimetomonotonic(struct timespec* kernelTime,
+			      struct timeval* result) {
   
-  //
-  // Set the current time as the time the probe was sent
-  // (although technically it hasn't been sent yet... but in
-  // few microseconds it will as soon as this function exits).
-  //
-
-  hopping_getcurrenttime(&probe->sentTime);
-
-  //
-  // Figure out if this is a retransmission of a previous probe.
+  struct timespec realNow;
+  struct timespec monotonicNow;
+  long long ns;
   
-  probe->nextRetransmission = 0;
-  probe->newProbeSentInsteadOfRetransmission = 0;
+  hopping_assert(kernelTime != 0);
+  hopping_assert(result != 0);
   
-  if (previousProbe == 0) {
-    probe->previousTransmission = 0;
-    hopping_timeadd(&probe->sentTime,
-		    HOPPING_INITIAL_RETRANSMISSION_TIMEOUT_US,
-		    &probe->initialTimeout);
-  } else {
-    unsigned long long prevTimeout =
-      hopping_timediffinusecs(&previousProbe->initialTimeout,
-			      &previousProbe->sentTime);
-    unsigned long long newTimeout =
-      prevTimeout * HOPPING_RETRANSMISSION_BACKOFF_FACTOR;
-    if (newTimeout > HOPPING_MAX_RETRANSMISSION_TIMEOUT_US)
-      newTimeout = HOPPING_MAX_RETRANSMISSION_TIMEOUT_US;
-    probe->previousTransmission = previousProbe;
-    previousProbe->nextRetransmission = probe;
-    hopping_timeadd(&probe->sentTime,
-		    newTimeout,
-		    &probe->initialTimeout);
+  if (clock_gettime(CLOCK_REALTIME, &realNow) < 0 ||
+      clock_gettime(CLOCK_MONOTONIC, &monotonicNow) < 0) {
+    fatalp("cannot determine current time via clock_gettime");
   }
   
-  debugf("registered a probe for id %u, ttl %u", id, hops);
+  ns =
+    ((long long)monotonicNow.tv_sec - realNow.tv_sec + kernelTime->tv_sec) * 1000 * 1000 * 1000 +
+    ((long long)monotonicNow.tv_nsec - realNow.tv_nsec + kernelTime->tv_nsec);
+  if (ns < 0) ns = 0;
+  result->tv_sec = ns / (1000 * 1000 * 1000);
+  result->tv_usec = (ns % (1000 * 1000 * 1000)) / 1000;
+}
+
+//
+// Time conversions to and from microseconds
+//
+
+static unsigned long long
+hopping_timetousecs(struct timeval* time) {
+  hopping_assert(time != 0);
+  return((unsigned long long)time->tv_sec * 1000 * 1000 + time->tv_usec);
+}
+
+static void
+hopping_usecstotime(unsigned long long us,
+		    struct timeval* result) {
+  hopping_assert(result != 0);
+  result->tv_sec = us / (1000 * 1000);
+  result->tv_usec = us % (1000 * 1000);
+}
+
+//
+// Probe timers ------------------------------------------------------
+//
+// Probe timeouts are kept in a hashed timer wheel. Each slot covers
+// HOPPING_TIMER_WHEEL_GRANULARITY_US, and holds a doubly linked list
+// of the probes whose timeout falls in that slot, so that arming and
+// cancelling a timer is O(1). A bitmap of the non-empty slots lets us
+// skip empty slots quickly when looking for expired timers or the
+// next deadline. The wheel covers about 32 seconds, which is more
+// than HOPPING_MAX_RETRANSMISSION_TIMEOUT_US, so all armed timers
+// are within one turn of the wheel from the current time.
+//
+// Ticks are counted from timerEpoch, the time the wheel was
+// initialized, so that a probe's deadline fits in 32 bits.
+//
+
+//
+// Get the timing and statistics part of a probe
+//
+
+static struct hopping_probestats*
+hopping_probestats(struct hopping_probe* probe) {
+  hopping_assert(probe != 0);
+  hopping_assert(probe >= probes && probe < probes + probeTableSize);
+  return(&probeStats[probe - probes]);
+}
+
+//
+// Initialize the timer wheel to start from the current time
+//
+
+static void
+hopping_timer_initialize(void) {
+  struct timeval now;
+  hopping_getcurrenttime(&now);
+  timerEpoch = hopping_timetousecs(&now);
+  timerWheelCursor = 0;
+}
+
+//
+// Convert between times and timer ticks. A time is rounded up to the
+// next tick, so that a timer never fires before its time.
+//
+
+static uint32_t
+hopping_timer_timetotick(struct timeval* time) {
   
-  probesSent++;
+  unsigned long long us;
   
-  return(probe);
+  hopping_assert(time != 0);
+  us = hopping_timetousecs(time);
+  if (us <= timerEpoch) return(0);
+  return((uint32_t)((us - timerEpoch + HOPPING_TIMER_WHEEL_GRANULARITY_US - 1) /
+		    HOPPING_TIMER_WHEEL_GRANULARITY_US));
+}
+
+static void
+hopping_timer_ticktotime(unsigned long long tick,
+			 struct timeval* result) {
+  hopping_assert(result != 0);
+  hopping_usecstotime(timerEpoch + tick * HOPPING_TIMER_WHEEL_GRANULARITY_US,
+		      result);
 }
 
 //
-// Find a probe based on TTL
+// Find the first non-empty slot starting from a given tick. Returns
+// 1 and sets the tick of that slot if one was found.
 //
 
-static struct hopping_probe*
-hopping_findprobe_basedonttl(unsigned char ttl) {
+static int
+hopping_timer_nextoccupied(unsigned long long fromTick,
+			   unsigned long long* resultTick) {
 
-  hopping_idtype id;
+  unsigned long long offset = 0;
 
-  //
-  // Look for a suitable probe in the probe table
-  //
+  hopping_assert(resultTick != 0);
   
-  for (id = 0; id < HOPPING_MAX_PROBES; id++) {
-    struct hopping_probe* probe = &probes[id];
-    if (probe->used &&
-	probe->hops == ttl) {
-      debugf("found a probe for TTL %u", ttl);
-      return(probe);
+  while (offset < HOPPING_TIMER_WHEEL_SLOTS) {
+    
+    unsigned int slot = (fromTick + offset) % HOPPING_TIMER_WHEEL_SLOTS;
+    unsigned int bit = slot % 64;
+    uint64_t word = timerWheelOccupied[slot / 64] >> bit;
+    
+    if (word != 0) {
+      offset += __builtin_ctzll(word);
+      if (offset >= HOPPING_TIMER_WHEEL_SLOTS) return(0);
+      *resultTick = fromTick + offset;
+      return(1);
     }
+    
+    offset += 64 - bit;
+    
   }
-
-  //
-  // Did not find one
-  //
-
-  debugf("cannot find a probe for TTL %u", ttl);
+  
   return(0);
 }
 
-
 //
-// Find a probe based on the ID
+// Stop the timer of a probe
 //
 
-static struct hopping_probe*
-hopping_findprobe(hopping_idtype id) {
+static void
+hopping_timer_cancel(struct hopping_probe* probe) {
+
+  hopping_assert(probe != 0);
   
-  struct hopping_probe* probe = &probes[id];
+  if (!probe->timerArmed) return;
   
-  if (!probe->used) {
-    debugf("have not sent a probe with id %u", (unsigned int)id);
-    return(0);
-  } else if (probe->responded) {
-    debugf("have already seen a response to the probe with id %u", (unsigned int)id);
-    return(0);
+  if (probe->timerPrev != 0) {
+    probe->timerPrev->timerNext = probe->timerNext;
   } else {
-    return(probe);
+    hopping_assert(timerWheel[probe->timerSlot] == probe);
+    timerWheel[probe->timerSlot] = probe->timerNext;
+  }
+  if (probe->timerNext != 0) {
+    probe->timerNext->timerPrev = probe->timerPrev;
+  }
+  if (timerWheel[probe->timerSlot] == 0) {
+    timerWheelOccupied[probe->timerSlot / 64] &= ~(1ULL << (probe->timerSlot % 64));
   }
   
+  probe->timerNext = 0;
+  probe->timerPrev = 0;
+  probe->timerArmed = 0;
 }
 
 //
-// Check if there is a probe based on TTL
+// Start (or restart) the timer of a probe, to fire at the probe's
+// deadline
 //
 
-static int
-hopping_thereisprobe_ttl(unsigned char ttl) {
-  int answer = (hopping_findprobe_basedonttl(ttl) != 0);
-  debugf("hopping_thereisprobe_ttl %u answer is %u", answer);
-  return(answer);
+static void
+hopping_timer_arm(struct hopping_probe* probe) {
+
+  unsigned long long tick;
+  unsigned int slot;
+
+  hopping_assert(probe != 0);
+  
+  if (probe->timerArmed) hopping_timer_cancel(probe);
+  
+  tick = probe->deadline;
+  if (tick < timerWheelCursor) tick = timerWheelCursor;
+  slot = tick % HOPPING_TIMER_WHEEL_SLOTS;
+  
+  probe->timerSlot = slot;
+  probe->timerPrev = 0;
+  probe->timerNext = timerWheel[slot];
+  if (timerWheel[slot] != 0) timerWheel[slot]->timerPrev = probe;
+  timerWheel[slot] = probe;
+  timerWheelOccupied[slot / 64] |= (1ULL << (slot % 64));
+  probe->timerArmed = 1;
 }
 
 //
-// Check if there is no probe based on TTL
+// Remove all timers that have expired by now from the wheel, and
+// return them as a list linked through timerNext
 //
 
-static int
-hopping_thereisnoprobe_ttl(unsigned char ttl) {
-  int answer = !hopping_thereisprobe_ttl(ttl);
-  debugf("hopping_thereisnoprobe_ttl %u answer is %u", ttl, answer);
-  return(answer);
+static struct hopping_probe*
+hopping_timer_expire(struct timeval* now) {
+
+  unsigned long long nowUs;
+  unsigned long long nowTick;
+  unsigned long long tick;
+  struct hopping_probe* expired = 0;
+
+  hopping_assert(now != 0);
+  
+  nowUs = hopping_timetousecs(now);
+  nowTick = nowUs <= timerEpoch ? 0 : (nowUs - timerEpoch) / HOPPING_TIMER_WHEEL_GRANULARITY_US;
+  tick = timerWheelCursor;
+  
+  while (tick <= nowTick &&
+	 hopping_timer_nextoccupied(tick,&tick) &&
+	 tick <= nowTick) {
+    
+    struct hopping_probe* probe = timerWheel[tick % HOPPING_TIMER_WHEEL_SLOTS];
+    
+    while (probe != 0) {
+      struct hopping_probe* next = probe->timerNext;
+      if (probe->deadline <= nowTick) {
+	hopping_timer_cancel(probe);
+	probe->timerNext = expired;
+	expired = probe;
+      }
+      probe = next;
+    }
+    
+    tick++;
+    
+  }
+  
+  if (nowTick > timerWheelCursor) timerWheelCursor = nowTick;
+  return(expired);
 }
 
 //
-// Count how many retranmissions this TTL has seen
+// Find the earliest timer deadline. Returns 0 if no timers are armed.
 //
 
-static unsigned int
-hopping_retries(struct hopping_probe* probe) {
-  hopping_assert(probe != 0);
-  if (probe->previousTransmission != 0) {
-    return(1+hopping_retries(probe->previousTransmission));
-  } else {
-    return(1);
+static int
+hopping_timer_nextdeadline(struct timeval* deadline) {
+
+  unsigned long long tick;
+  unsigned long long earliest = 0;
+  struct hopping_probe* probe;
+  int found = 0;
+
+  hopping_assert(deadline != 0);
+  
+  if (!hopping_timer_nextoccupied(timerWheelCursor,&tick)) return(0);
+  
+  for (probe = timerWheel[tick % HOPPING_TIMER_WHEEL_SLOTS];
+       probe != 0;
+       probe = probe->timerNext) {
+    if (!found || probe->deadline < earliest) earliest = probe->deadline;
+    found = 1;
   }
+  
+  hopping_assert(found);
+  hopping_timer_ticktotime(earliest,deadline);
+  return(1);
 }
 
 //
-// Count how many probes we have NOT yet sent on a given range
+// Add (delta 1) or remove (delta -1) a probe's contribution to its
+// destination's response counters, based on the probe's current
+// state. The counters keep hopping_responses() and the other
+// counting functions constant time.
 //
 
-static unsigned int
-hopping_countprobes_notsentinrange(unsigned char fromttl,
-				   unsigned char tottl) {
-
-  unsigned int index = (unsigned int)fromttl;
-  unsigned int count = 0;
+static void
+hopping_countprobe(struct hopping_probe* probe,
+		   int delta) {
+  
+  struct hopping_destination* destination;
+  
+  hopping_assert(probe != 0);
+  destination = probe->destination;
+  hopping_assert(destination != 0);
   
-  for (index = 0; index < (unsigned int)tottl; index++) {
-    if (hopping_thereisnoprobe_ttl((unsigned char)index)) {
-      count++;
+  if (!probe->responded) {
+    if (probe->responseType != hopping_responseType_noResponse &&
+	probe->responseType != hopping_responseType_cancelled) {
+      destination->nWaitingResponses += delta;
     }
+    return;
   }
   
-  return(count);
+  destination->nResponses += delta;
+  switch (probe->responseType) {
+  case hopping_responseType_echoResponse:
+    destination->nReplyResponses += delta;
+    break;
+  case hopping_responseType_timeExceeded:
+    destination->nTimeExceededResponses += delta;
+    break;
+  case hopping_responseType_destinationUnreachable:
+    destination->nUnreachableResponses += delta;
+    break;
+  default:
+    break;
+  }
 }
 
 //
-// Task management, initialize the bucket
-// algorithm.
+// Change the response state of a probe, keeping the counters up to
+// date
 //
 
 static void
-hopping_bucket_initialize(unsigned int tasks) {
-  bucket = tasks;
+hopping_setprobestate(struct hopping_probe* probe,
+		      int responded,
+		      enum hopping_responseType responseType) {
+  hopping_assert(probe != 0);
+  hopping_countprobe(probe,-1);
+  probe->responded = responded;
+  probe->responseType = responseType;
+  hopping_countprobe(probe,1);
 }
 
 //
-// Task management, are we allowed to take on a new
-// task?
+// Set a probe's retransmission timeout, counting from the time the
+// probe was sent, and compute the timer deadline from it. The timer
+// itself is not (re)armed here.
 //
 
-static int
-hopping_bucket_cantakeontask() {
-  return(bucket > 0);
+static void
+hopping_setprobetimeout(struct hopping_probe* probe,
+			unsigned long long timeout) {
+  
+  struct hopping_probestats* stats = hopping_probestats(probe);
+  struct timeval deadline;
+  
+  if (timeout > HOPPING_MAX_RETRANSMISSION_TIMEOUT_US)
+    timeout = HOPPING_MAX_RETRANSMISSION_TIMEOUT_US;
+  stats->timeoutUSecs = timeout;
+  hopping_timeadd(&stats->sentTime,timeout,&deadline);
+  probe->deadline = hopping_timer_timetotick(&deadline);
 }
 
 //
-// Task management, take on a task per the bucket
-// algorithm.
+// Feed a round-trip time sample to an estimator, as in RFC 6298
 //
 
 static void
-hopping_bucket_taketask() {
-  if (bucket > 0) bucket--;
+hopping_rtt_update(struct hopping_rttestimator* estimator,
+		   unsigned long sampleUSecs) {
+  
+  unsigned long difference;
+  
+  hopping_assert(estimator != 0);
+  
+  if (estimator->samples == 0) {
+    estimator->srttUSecs = sampleUSecs;
+    estimator->rttvarUSecs = sampleUSecs / 2;
+  } else {
+    difference = (estimator->srttUSecs > sampleUSecs ?
+		  estimator->srttUSecs - sampleUSecs :
+		  sampleUSecs - estimator->srttUSecs);
+    estimator->rttvarUSecs = (3 * estimator->rttvarUSecs + difference) / 4;
+    estimator->srttUSecs = (7 * estimator->srttUSecs + sampleUSecs) / 8;
+  }
+  estimator->samples++;
 }
 
 //
-// Task management, allow a task to continue per the bucket
-// algorithm.
+// The retransmission timeout that an estimator suggests
 //
 
-static void
-hopping_bucket_releasetask() {
-  bucket++;
-  if (bucket > parallel) bucket = parallel;
+static unsigned long long
+hopping_rtt_timeout(const struct hopping_rttestimator* estimator) {
+  
+  unsigned long long timeout;
+  
+  hopping_assert(estimator != 0);
+  hopping_assert(estimator->samples > 0);
+  
+  timeout = (unsigned long long)estimator->srttUSecs +
+    hopping_max(HOPPING_TIMER_WHEEL_GRANULARITY_US,4 * estimator->rttvarUSecs);
+  if (timeout < HOPPING_MIN_RETRANSMISSION_TIMEOUT_US)
+    timeout = HOPPING_MIN_RETRANSMISSION_TIMEOUT_US;
+  return(timeout);
 }
 
 //
-// Register the reception of a response (ECHO, UNREACHABLE or TIME
-// EXCEEDED) to a probe.
+// A response to a probe with a given TTL arrived after delayUSecs.
+// Every transmission is a probe of its own with its own id, so unlike
+// in TCP, responses to retransmissions are not ambiguous and can be
+// used as samples too.
 //
 
 static void
-hopping_registerResponse(enum hopping_responseType type,
-			 hopping_idtype id,
-			 unsigned char responseTtl,
-			 unsigned int packetLength,
-			 struct hopping_probe** responseToProbe) {
+hopping_rtt_sample(struct hopping_destination* destination,
+		   unsigned char hops,
+		   unsigned long delayUSecs) {
+  hopping_assert(destination != 0);
+  hopping_rtt_update(&destination->rtt,delayUSecs);
+  hopping_rtt_update(&destination->rttBands[hops / HOPPING_RTT_BAND_WIDTH],delayUSecs);
+}
 
-  //
-  // See if we can find the probe that this is a response to
-  //
+//
+// The timeout for the first transmission of a probe with a given
+// TTL: from the estimator of its TTL band, or if there are no
+// samples from that band yet, from all samples for the destination
+//
+
+static unsigned long long
+hopping_rtt_initialtimeout(struct hopping_destination* destination,
+			   unsigned char hops) {
+  
+  struct hopping_rttestimator* band;
+  
+  hopping_assert(destination != 0);
+  
+  band = &destination->rttBands[hops / HOPPING_RTT_BAND_WIDTH];
+  if (band->samples > 0) return(hopping_rtt_timeout(band));
+  if (destination->rtt.samples > 0) return(hopping_rtt_timeout(&destination->rtt));
+  return(HOPPING_INITIAL_RETRANSMISSION_TIMEOUT_US);
+}
+
+//
+// Add a new probe entry
+//
+
+static struct hopping_probe*
+hopping_newprobe(struct hopping_destination* destination,
+		 hopping_idtype id,
+		 unsigned char hops,
+		 unsigned int probeLength,
+		 struct hopping_probe* previousProbe) {
+  
+  struct hopping_probe* probe;
+  struct hopping_probestats* stats;
+  hopping_assert(destination != 0);
+  hopping_assert(id < probeTableSize);
+  probe = &probes[id];
+  stats = &probeStats[id];
+  if (probe->used) {
+    fatalf("cannot allocate a new probe for id %u", (unsigned int)id);
+    return(0);
+  }
+
+  memset(probe,0,sizeof(*probe));
+  memset(stats,0,sizeof(*stats));
+  
+  probe->used = 1;
+  probe->id = id;
+  probe->destination = destination;
+  probe->hops = hops;
+  stats->probeLength = probeLength;
+  probe->responded = 0;
+  stats->duplicateResponses = 0;
+  probe->responseType = hopping_responseType_stillWaiting;
+  
+  //
+  // Add the probe to the destination's list, index it by its TTL,
+  // and count it
+  //
+  
+  if (destination->probeListTail != 0) hopping_probestats(destination->probeListTail)->destinationNext = probe;
+  else destination->probeList = probe;
+  destination->probeListTail = probe;
+  destination->ttlsProbed[hops / 64] |= (1ULL << (hops % 64));
+  if (destination->ttlProbes[hops] == 0) destination->ttlProbes[hops] = probe;
+  destination->nProbes++;
+  hopping_countprobe(probe,1);
+  
+  //
+  // Set the current time as the time the probe was sent
+  // (although technically it hasn't been sent yet... but in
+  // few microseconds it will as soon as this function exits).
+  // If kernel timestamps are in use, the time is corrected
+  // when the kernel reports the actual transmission time.
+  //
+
+  hopping_getcurrenttime(&stats->sentTime);
+  stats->kernelSentTime = 0;
+  stats->kernelResponseTime = 0;
+
+  //
+  // Figure out if this is a retransmission of a previous probe.
+  
+  probe->nextRetransmission = 0;
+  stats->newProbeSentInsteadOfRetransmission = 0;
+  
+  if (previousProbe == 0) {
+    stats->previousTransmission = 0;
+    probe->tries = 1;
+    hopping_setprobetimeout(probe,hopping_rtt_initialtimeout(destination,hops));
+  } else {
+    stats->previousTransmission = previousProbe;
+    previousProbe->nextRetransmission = probe;
+    probe->tries = previousProbe->tries + 1;
+    hopping_setprobetimeout(probe,
+			    hopping_probestats(previousProbe)->timeoutUSecs *
+			    HOPPING_RETRANSMISSION_BACKOFF_FACTOR);
+  }
+  hopping_timer_arm(probe);
+  
+  debugf("registered a probe for id %u, ttl %u", id, hops);
+  
+  destination->probesSent++;
+  
+  return(probe);
+}
+
+//
+// The kernel has reported the actual transmission time of a
+// probe. Move the probe's send time and retransmission timeout
+// accordingly.
+//
+
+static void
+hopping_settransmittime(struct hopping_probe* probe,
+			struct timeval* sentTime) {
+  
+  struct hopping_probestats* stats;
+  
+  hopping_assert(probe != 0);
+  hopping_assert(sentTime != 0);
+  stats = hopping_probestats(probe);
+  
+  if (hopping_timeisless(sentTime,&stats->sentTime)) return;
+  
+  debugf("kernel reports probe id %u sent %llu us after it was queued",
+	 probe->id,
+	 hopping_timediffinusecs(sentTime,&stats->sentTime));
+  
+  stats->sentTime = *sentTime;
+  stats->kernelSentTime = 1;
+  hopping_setprobetimeout(probe,stats->timeoutUSecs);
+  if (probe->timerArmed) {
+    hopping_timer_cancel(probe);
+    hopping_timer_arm(probe);
+  }
+}
+
+//
+// Find a probe based on TTL
+//
+
+static struct hopping_probe*
+hopping_findprobe_basedonttl(struct hopping_destination* destination,
+			     unsigned char ttl) {
+
+  struct hopping_probe* probe;
+  
+  hopping_assert(destination != 0);
+  
+  //
+  // Look for a probe in the destination's TTL index
+  //
+  
+  probe = destination->ttlProbes[ttl];
+  if (probe != 0) {
+    debugf("found a probe for TTL %u", ttl);
+  } else {
+    debugf("cannot find a probe for TTL %u", ttl);
+  }
+  return(probe);
+}
+
+
+//
+// Find a probe based on the ID
+//
+
+static struct hopping_probe*
+hopping_findprobe(hopping_idtype id) {
+  
+  struct hopping_probe* probe;
+  
+  if (id >= probeTableSize) {
+    debugf("id %u is outside the probe table", (unsigned int)id);
+    return(0);
+  }
+  
+  probe = &probes[id];
+  if (!probe->used) {
+    debugf("have not sent a probe with id %u", (unsigned int)id);
+    return(0);
+  } else if (probe->responded) {
+    debugf("have already seen a response to the probe with id %u", (unsigned int)id);
+    return(0);
+  } else {
+    return(probe);
+  }
+  
+}
+
+//
+// Check if there is a probe based on TTL
+//
+
+static int
+hopping_thereisprobe_ttl(struct hopping_destination* destination,
+			 unsigned char ttl) {
+  int answer = (hopping_findprobe_basedonttl(destination,ttl) != 0);
+  debugf("hopping_thereisprobe_ttl %u answer is %u", ttl, answer);
+  return(answer);
+}
+
+//
+// Count how many retranmissions this TTL has seen
+//
+
+static unsigned int
+hopping_retries(struct hopping_probe* probe) {
+  hopping_assert(probe != 0);
+  return(probe->tries);
+}
+
+//
+// Count the TTLs in a range (inclusive) on which probes have been
+// sent, from the destination's bitset of probed TTLs
+//
+
+static unsigned int
+hopping_countprobes_sentinrange(struct hopping_destination* destination,
+				unsigned char fromttl,
+				unsigned char tottl) {
+  
+  unsigned int count = 0;
+  unsigned int word;
+  
+  hopping_assert(destination != 0);
+  hopping_assert(fromttl <= tottl);
+  
+  for (word = fromttl / 64; word <= (unsigned int)tottl / 64; word++) {
+    
+    unsigned int low = (word == fromttl / 64) ? fromttl % 64 : 0;
+    unsigned int high = (word == (unsigned int)tottl / 64) ? tottl % 64 : 63;
+    uint64_t mask = (high == 63 ? ~0ULL : ((1ULL << (high + 1)) - 1)) & ~((1ULL << low) - 1);
+    
+    count += __builtin_popcountll(destination->ttlsProbed[word] & mask);
+    
+  }
+  
+  return(count);
+}
+
+//
+// Check if a TTL is in a bitset of TTLs, such as the destination's
+// set of probed TTLs
+//
+
+static int
+hopping_ttlinset(const uint64_t* set,
+		 unsigned int ttl) {
+  hopping_assert(set != 0);
+  hopping_assert(ttl <= 255);
+  return((set[ttl / 64] >> (ttl % 64)) & 1);
+}
+
+//
+// Count how many probes we have NOT yet sent on a given range
+//
+
+static unsigned int
+hopping_countprobes_notsentinrange(struct hopping_destination* destination,
+				   unsigned char fromttl,
+				   unsigned char tottl) {
+  
+  hopping_assert(fromttl <= tottl);
+  return(((unsigned int)tottl - (unsigned int)fromttl + 1) -
+	 hopping_countprobes_sentinrange(destination,fromttl,tottl));
+}
+
+//
+// Task management, initialize the bucket
+// algorithm.
+//
+
+static void
+hopping_bucket_initialize(struct hopping_destination* destination,
+			  unsigned int tasks) {
+  destination->bucket = tasks;
+}
+
+//
+// Task management, are we allowed to take on a new
+// task?
+//
+
+static int
+hopping_bucket_cantakeontask(struct hopping_destination* destination) {
+  return(destination->bucket > 0);
+}
+
+//
+// Task management, take on a task per the bucket
+// algorithm.
+//
+
+static void
+hopping_bucket_taketask(struct hopping_destination* destination) {
+  if (destination->bucket > 0) destination->bucket--;
+}
+
+//
+// Task management, allow a task to continue per the bucket
+// algorithm.
+//
+
+static void
+hopping_bucket_releasetask(struct hopping_destination* destination) {
+  destination->bucket++;
+  if (destination->bucket > parallel) destination->bucket = parallel;
+}
+
+//
+// Cancel the probes still waiting for a response whose response could
+// no longer tell anything new, because the learned range excludes
+// their TTL. A probe with TTL t can only narrow the range if
+// hopsMinInclusive <= t < hopsMaxInclusive. Cancelled probes are not
+// retransmitted, nor waited for, and their tasks are released for
+// more useful probes. A late response to a cancelled probe is still
+// taken into account.
+//
+
+static void
+hopping_canceluselessprobes(struct hopping_destination* destination) {
+  
+  struct hopping_probe* probe;
+  
+  hopping_assert(destination != 0);
+  
+  if (hopping_waitingforresponses(destination) == 0) return;
+  
+  for (probe = destination->probeList;
+       probe != 0;
+       probe = hopping_probestats(probe)->destinationNext) {
+    
+    if (probe->responded ||
+	probe->responseType != hopping_responseType_stillWaiting) continue;
+    if (probe->hops >= destination->hopsMinInclusive &&
+	probe->hops < destination->hopsMaxInclusive) continue;
+    
+    debugf("cancelling probe id %u ttl %u outside range %u..%u",
+	   probe->id, probe->hops,
+	   destination->hopsMinInclusive, destination->hopsMaxInclusive);
+    hopping_timer_cancel(probe);
+    hopping_setprobestate(probe,0,hopping_responseType_cancelled);
+    hopping_reportprogress_received(destination,
+				    hopping_responseType_cancelled,
+				    probe->id,
+				    probe->hops);
+    if (!probe->speculative && !probe->redundant) hopping_bucket_releasetask(destination);
+    
+  }
+}
+
+//
+// Register the reception of a response (ECHO, UNREACHABLE or TIME
+// EXCEEDED) to a probe.
+//
+
+static void
+hopping_registerResponse(enum hopping_responseType type,
+			 hopping_idtype id,
+			 unsigned char responseTtl,
+			 unsigned int packetLength,
+			 struct timeval* receivedTime,
+			 int kernelReceivedTime,
+			 struct hopping_probe** responseToProbe) {
+
+  //
+  // See if we can find the probe that this is a response to
+  //
   
   struct hopping_probe* probe = hopping_findprobe(id);
+  struct hopping_probestats* stats;
+  struct hopping_destination* destination;
+  int wasCancelled;
 
+  hopping_assert(receivedTime != 0);
   hopping_assert(responseToProbe != 0);
   
   if (probe == 0) {
@@ -951,6 +1783,8 @@ hopping_registerResponse(enum hopping_responseType type,
     *responseToProbe = 0;
     return;
   }
+  destination = probe->destination;
+  stats = hopping_probestats(probe);
   
   //
   // Look at the state of the probe
@@ -959,7 +1793,20 @@ hopping_registerResponse(enum hopping_responseType type,
   if (probe->responded) {
     debugf("we have already seen a response to probe id %u", id);
     *responseToProbe = probe;
-    probe->duplicateResponses++;
+    stats->duplicateResponses++;
+    return;
+  }
+  
+  //
+  // A response to a redundant copy of a probe that another copy
+  // already got a response for is a duplicate
+  //
+  
+  wasCancelled = (probe->responseType == hopping_responseType_cancelled);
+  if (wasCancelled && hopping_redundancy_answered(probe) != 0) {
+    debugf("probe id %u is a redundant copy of one already responded to", id);
+    *responseToProbe = hopping_redundancy_answered(probe);
+    hopping_probestats(*responseToProbe)->duplicateResponses++;
     return;
   }
   
@@ -968,13 +1815,18 @@ hopping_registerResponse(enum hopping_responseType type,
   //
   
   debugf("this is a new valid response to probe id %u", id);
-  probe->responded = 1;
-  probe->responseLength = packetLength;
-  hopping_getcurrenttime(&probe->responseTime);
-  probe->delayUSecs = hopping_timediffinusecs(&probe->responseTime,
-						  &probe->sentTime);
-  debugf("probe delay was %.3f ms", probe->delayUSecs / 1000.0);
-  probe->responseType = type;
+  hopping_timer_cancel(probe);
+  stats->responseLength = packetLength;
+  stats->responseTime = *receivedTime;
+  stats->kernelResponseTime = kernelReceivedTime;
+  if (hopping_timeisless(&stats->responseTime,&stats->sentTime)) {
+    stats->responseTime = stats->sentTime;
+  }
+  stats->delayUSecs = hopping_timediffinusecs(&stats->responseTime,
+					      &stats->sentTime);
+  debugf("probe delay was %.3f ms", stats->delayUSecs / 1000.0);
+  hopping_rtt_sample(destination,probe->hops,stats->delayUSecs);
+  hopping_setprobestate(probe,1,type);
   
   //
   // Update our conclusions about the destination
@@ -982,8 +1834,8 @@ hopping_registerResponse(enum hopping_responseType type,
   
   if (type == hopping_responseType_echoResponse) {
     
-    hopsMaxInclusive = hopping_min(hopsMaxInclusive, probe->hops);
-    debugf("echo reply means hops is at most %u", hopsMaxInclusive);
+    destination->hopsMaxInclusive = hopping_min(destination->hopsMaxInclusive, probe->hops);
+    debugf("echo reply means hops is at most %u", destination->hopsMaxInclusive);
     
     //
     // Additional conclusions can be drawn as suggested
@@ -993,34 +1845,36 @@ hopping_registerResponse(enum hopping_responseType type,
     // 255.
     //
 
-    hopsMaxInclusive = (unsigned char)(hopping_min((unsigned int)hopsMaxInclusive,
+    destination->hopsMaxInclusive = (unsigned char)(hopping_min((unsigned int)destination->hopsMaxInclusive,
 						   (unsigned int)256 - (unsigned int)responseTtl));
-    debugf("hopsMinInclusive %u hopsMaxInclusive %u", hopsMinInclusive, hopsMaxInclusive);
-    if (hopsMaxInclusive < hopsMinInclusive) {
+    debugf("hopsMinInclusive %u hopsMaxInclusive %u", destination->hopsMinInclusive, destination->hopsMaxInclusive);
+    if (destination->hopsMaxInclusive < destination->hopsMinInclusive) {
       warnf("TTL in an ECHO REPLY is too large compared to current window");
-      hopsMaxInclusive = hopsMinInclusive;
+      destination->hopsMaxInclusive = destination->hopsMinInclusive;
     }
     
     debugf("echo reply TTL was %u so hops must be at most %u",
-	   responseTtl, hopsMaxInclusive);
-    
-    //
-    // TODO: one might also optimistically assume that
-    // sender used default TTL of 64, in which case we
-    // can pretty much guess what the TTL is.
-    //
+	   responseTtl, destination->hopsMaxInclusive);
     
   }
   if (type == hopping_responseType_timeExceeded && probe->hops < 255) {
-    hopsMinInclusive = hopping_max(hopsMinInclusive,probe->hops + 1);
-    debugf("time exceeded means hops is at least %u", hopsMinInclusive);
+    destination->hopsMinInclusive = hopping_max(destination->hopsMinInclusive,probe->hops + 1);
+    debugf("time exceeded means hops is at least %u", destination->hopsMinInclusive);
+  }
+  if (algorithm == hopping_algorithms_bayes) {
+    hopping_bayes_observe(destination,probe->hops,type,responseTtl,probe->tries);
   }
   
   //
   // Update the task counters
   //
   
-  hopping_bucket_releasetask();
+  if (!wasCancelled && !probe->speculative && !probe->redundant) hopping_bucket_releasetask(destination);
+  hopping_redundancy_satisfy(probe);
+  hopping_canceluselessprobes(destination);
+  if (fingerprint) {
+    hopping_fingerprint_observe(destination,type,responseTtl);
+  }
   
   //
   // Return, and set output parameters
@@ -1030,33 +1884,145 @@ hopping_registerResponse(enum hopping_responseType type,
 }
 
 //
-// Allocate new identifiers for the different probes
+// Allocate the probe table. It is sized for all the destinations
+// that may be active at the same time, up to HOPPING_MAX_PROBES.
+//
+// A probe is identified by its slot in the table. The slot does not
+// fit in the 16-bit ICMP id, so its high bits go to the low bits of
+// the ICMP sequence number, and the rest of the sequence number
+// carries a generation that changes every time the slot is
+// reused. A late response to a probe whose slot has since been given
+// to another probe does not match the generation, and is ignored.
 //
 
-static hopping_idtype
-hopping_getnewid(unsigned char hops) {
-  
-  static unsigned int nextId = 0;
-  unsigned int id;
+static void
+hopping_initprobes(void) {
+
+  unsigned long long size = maxProbes;
+  unsigned int slot;
+  
+  if (targetsFile != 0) size *= concurrentDestinations;
+  if (size < HOPPING_MIN_PROBES) size = HOPPING_MIN_PROBES;
+  if (size > HOPPING_MAX_PROBES) size = HOPPING_MAX_PROBES;
+  probeTableSize = (unsigned int)size;
+  debugf("probe table has %u entries", probeTableSize);
+  
+  probes = (struct hopping_probe*)calloc(probeTableSize,sizeof(*probes));
+  probeStats = (struct hopping_probestats*)calloc(probeTableSize,sizeof(*probeStats));
+  probeGenerations = (uint16_t*)calloc(probeTableSize,sizeof(*probeGenerations));
+  freeSlots = (hopping_idtype*)malloc(probeTableSize * sizeof(*freeSlots));
+  if (probes == 0 || probeStats == 0 || probeGenerations == 0 || freeSlots == 0) {
+    fatalf("cannot allocate memory for %u probes", probeTableSize);
+  }
   
-  do {
-    
-    id = nextId++;
-    struct hopping_probe* probe = &probes[id];
-    if (probe->used) continue;
-    else return(id);
-    
-  } while (id <= 65535 && id +1 < HOPPING_MAX_PROBES);
+  //
+  // Free slots are kept in a stack, with the lowest slots on top
+  //
   
-  fatalf("cannot find a new identifier for %u hops", hops);
-  return(0);
+  for (slot = 0; slot < probeTableSize; slot++) {
+    freeSlots[slot] = probeTableSize - 1 - slot;
+  }
+  nFreeSlots = probeTableSize;
 }
 
 //
-// Finding out an interface index for a named interface
+// The ICMP id and sequence number that carry a probe's slot and
+// generation
 //
 
-static void
+static uint16_t
+hopping_probewireid(hopping_idtype id) {
+  return((uint16_t)(id & 0xFFFF));
+}
+
+static uint16_t
+hopping_probewireseq(hopping_idtype id) {
+  hopping_assert(id < probeTableSize);
+  return((uint16_t)((id >> 16) |
+		    ((probeGenerations[id] & HOPPING_GENERATION_MASK) << HOPPING_SLOT_HIGH_BITS)));
+}
+
+//
+// Find the probe slot that an ICMP id and sequence number from a
+// response refer to. Returns 1 and sets the slot if the slot is in
+// use and the generation matches.
+//
+
+static int
+hopping_matchprobe(uint16_t wireId,
+		   uint16_t wireSeq,
+		   hopping_idtype* result) {
+  
+  hopping_idtype id =
+    (hopping_idtype)wireId |
+    ((hopping_idtype)(wireSeq & ((1 << HOPPING_SLOT_HIGH_BITS) - 1)) << 16);
+  
+  hopping_assert(result != 0);
+  
+  if (id >= probeTableSize) {
+    debugf("id %u is outside the probe table", id);
+    return(0);
+  }
+  if (!probes[id].used ||
+      (wireSeq >> HOPPING_SLOT_HIGH_BITS) != (probeGenerations[id] & HOPPING_GENERATION_MASK)) {
+    debugf("response to id %u is for an earlier use of the slot", id);
+    return(0);
+  }
+  
+  *result = id;
+  return(1);
+}
+
+//
+// Get a free probe slot
+//
+
+static hopping_idtype
+hopping_getnewid(unsigned char hops) {
+  
+  hopping_idtype id;
+  
+  if (nFreeSlots == 0) {
+    fatalf("cannot find a new identifier for %u hops", hops);
+  }
+  
+  id = freeSlots[--nFreeSlots];
+  hopping_assert(!probes[id].used);
+  probeGenerations[id]++;
+  return(id);
+}
+
+//
+// Release all the probe entries of a destination
+//
+
+static void
+hopping_freeprobes(struct hopping_destination* destination) {
+
+  struct hopping_probe* probe;
+
+  hopping_assert(destination != 0);
+  
+  probe = destination->probeList;
+  while (probe != 0) {
+    struct hopping_probe* next = hopping_probestats(probe)->destinationNext;
+    hopping_assert(probe->used && probe->destination == destination);
+    hopping_timer_cancel(probe);
+    freeSlots[nFreeSlots++] = probe->id;
+    memset(hopping_probestats(probe),0,sizeof(struct hopping_probestats));
+    memset(probe,0,sizeof(*probe));
+    probe = next;
+  }
+  destination->probeList = 0;
+  destination->probeListTail = 0;
+  
+}
+
+//
+// Finding out an interface index for a named interface
+//
+
+static void
 hopping_getifindex(const char* interface,
 		   int* ifIndex,
 		   struct ifreq* ifrp,
@@ -1107,7 +2073,12 @@ hopping_getifindex(const char* interface,
   close (sd);
 }
 
-static void
+//
+// Resolve a destination name to an address. Returns 1 on success, 0
+// if the name cannot be resolved (after reporting why).
+//
+
+static int
 hopping_getdestinationaddress(const char* destination,
 			      struct sockaddr_in* address) {
   
@@ -1125,9 +2096,11 @@ hopping_getdestinationaddress(const char* destination,
   
   if ((rcode = getaddrinfo(destination, NULL, &hints, &res)) != 0) {
     fprintf (stderr, "hopping: cannot resolve address %s: %s\n", destination, gai_strerror (rcode));
-    exit(1);
+    return(0);
   }
   *address = *(struct sockaddr_in*)res->ai_addr;
+  freeaddrinfo(res);
+  return(1);
 }
 
 //
@@ -1141,35 +2114,147 @@ hopping_iptostring(struct sockaddr_in* in) {
   if (inet_ntop (AF_INET, (void*)&in->sin_addr, result, INET_ADDRSTRLEN) == NULL) {
     fatalf("inet_ntop() failed");
   }
+  return(result);
+}
+
+//
+// Checksum per RFC 1071 ------------------------------------------------
+//
+// The checksum is the one's complement of the one's complement sum of
+// the 16-bit words in the data. The sum can be computed in any order
+// and with any number of carry bits, as long as the carries are
+// folded back in at the end. The vector versions below add eight or
+// sixteen words at a time into 32-bit lanes, which cannot overflow
+// for any IP packet. The best version for the CPU is selected at run
+// time.
+//
+
+//
+// Plain C version of the sum
+//
+
+static uint64_t
+hopping_checksumsum_scalar(const unsigned char* data,
+			   int length) {
+  
+  uint64_t sum = 0;
+  uint16_t word;
+  
+  while (length > 1) {
+    memcpy(&word,data,sizeof(word));
+    sum += word;
+    data += 2;
+    length -= 2;
+  }
+  
+  if (length > 0) {
+    sum += *(uint8_t*)data;
+  }
+  
+  return(sum);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+//
+// SSE2 version of the sum
+//
+
+__attribute__((target("sse2")))
+static uint64_t
+hopping_checksumsum_sse2(const unsigned char* data,
+			 int length) {
+  
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc = _mm_setzero_si128();
+  uint32_t lanes[4];
+  uint64_t sum;
+  
+  while (length >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)data);
+    acc = _mm_add_epi32(acc,_mm_unpacklo_epi16(v,zero));
+    acc = _mm_add_epi32(acc,_mm_unpackhi_epi16(v,zero));
+    data += 16;
+    length -= 16;
+  }
+  
+  _mm_storeu_si128((__m128i*)lanes,acc);
+  sum = (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  return(sum + hopping_checksumsum_scalar(data,length));
+}
+
+//
+// AVX2 version of the sum
+//
+
+__attribute__((target("avx2")))
+static uint64_t
+hopping_checksumsum_avx2(const unsigned char* data,
+			 int length) {
+  
+  __m256i zero = _mm256_setzero_si256();
+  __m256i acc = _mm256_setzero_si256();
+  uint32_t lanes[8];
+  uint64_t sum;
+  
+  while (length >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)data);
+    acc = _mm256_add_epi32(acc,_mm256_unpacklo_epi16(v,zero));
+    acc = _mm256_add_epi32(acc,_mm256_unpackhi_epi16(v,zero));
+    data += 32;
+    length -= 32;
+  }
+  
+  _mm256_storeu_si256((__m256i*)lanes,acc);
+  sum =
+    (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+    lanes[4] + lanes[5] + lanes[6] + lanes[7];
+  return(sum + hopping_checksumsum_sse2(data,length));
+}
+
+#endif
+
+//
+// Select the sum function for this CPU
+//
+
+static hopping_checksumsum_function
+hopping_checksumsum_select(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    debugf("using AVX2 checksums");
+    return(hopping_checksumsum_avx2);
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    debugf("using SSE2 checksums");
+    return(hopping_checksumsum_sse2);
+  }
+#endif
+  return(hopping_checksumsum_scalar);
 }
 
 //
-// Checksum per RFC 1071
+// Compute the checksum
 //
 
 static uint16_t
 hopping_checksum(uint16_t* data,
 		     int length)
 {
-  register uint32_t sum = 0;
-  int count = length;
+  static hopping_checksumsum_function sumfunction = 0;
+  uint64_t sum;
 
   hopping_assert(data != 0);
   
-  while (count > 1) {
-    sum += *(data++);
-    count -= 2;
-  }
-  
-  if (count > 0) {
-    sum += *(uint8_t*)data;
-  }
+  if (sumfunction == 0) sumfunction = hopping_checksumsum_select();
+  sum = (*sumfunction)((const unsigned char*)data,length);
   
   while (sum >> 16) {
     sum = (sum & 0xffff) + (sum >> 16);
   }
   
-  return(~sum);
+  return((uint16_t)~sum);
 }
 
 //
@@ -1180,13 +2265,13 @@ static void
 hopping_constructicmp4packet(struct sockaddr_in* source,
 			     struct sockaddr_in* destination,
 			     hopping_idtype id,
+			     uint16_t seq,
 			     unsigned char ttl,
+			     const char* data,
 			     unsigned int dataLength,
 			     char** resultPacket,
 			     unsigned int* resultPacketLength) {
   
-  static const char* message = "archtester";
-  static char data[IP_MAXPACKET];
   static char packet[IP_MAXPACKET];
   struct icmp icmphdr;
   struct ip iphdr;
@@ -1199,6 +2284,7 @@ hopping_constructicmp4packet(struct sockaddr_in* source,
 
   hopping_assert(source != 0);
   hopping_assert(destination != 0);
+  hopping_assert(data != 0 || dataLength == 0);
   hopping_assert(resultPacket != 0);
   hopping_assert(resultPacketLength != 0);
   
@@ -1213,9 +2299,8 @@ hopping_constructicmp4packet(struct sockaddr_in* source,
   icmphdr.icmp_type = HOPPING_ICMP_ECHO;
   icmphdr.icmp_code = 0;
   icmphdr.icmp_id = id;
-  icmphdr.icmp_seq = (uint16_t)(probesSent & 0xFFFF);
+  icmphdr.icmp_seq = seq;
   icmphdr.icmp_cksum = 0;
-  hopping_fillwithstring(data,message,dataLength);
   icmpLength = HOPPING_ICMP4_HDRLEN + dataLength;
   memcpy(packet + HOPPING_IP4_HDRLEN,&icmphdr,HOPPING_ICMP4_HDRLEN);
   memcpy(packet + HOPPING_IP4_HDRLEN + HOPPING_ICMP4_HDRLEN,data,dataLength);
@@ -1256,176 +2341,659 @@ hopping_constructicmp4packet(struct sockaddr_in* source,
 }
 
 //
-// Send a plain IP packet to raw socket
+// Update a checksum after a 16-bit word in the checksummed data has
+// changed, without going through all of the data again (RFC 1624,
+// equation 3)
+//
+
+static uint16_t
+hopping_checksumupdate(uint16_t checksum,
+		       uint16_t oldValue,
+		       uint16_t newValue) {
+  
+  uint32_t sum = (uint16_t)~checksum;
+  
+  sum += (uint16_t)~oldValue;
+  sum += newValue;
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  
+  return((uint16_t)~sum);
+}
+
+//
+// Replace a 16-bit word in a header, and update the header's
+// checksum accordingly. The word and checksum are at given offsets,
+// and in the order they are in the packet.
 //
 
 static void
-hopping_sendpacket(int sd,
-		   char* packet,
-		   unsigned int packetLength,
-		   struct sockaddr* addr,
-		   size_t addrLength)  {
+hopping_patchword(char* header,
+		  unsigned int offset,
+		  unsigned int checksumOffset,
+		  uint16_t newValue) {
+  
+  uint16_t oldValue;
+  uint16_t checksum;
+  
+  memcpy(&oldValue,header + offset,sizeof(oldValue));
+  memcpy(&checksum,header + checksumOffset,sizeof(checksum));
+  checksum = hopping_checksumupdate(checksum,oldValue,newValue);
+  memcpy(header + offset,&newValue,sizeof(newValue));
+  memcpy(header + checksumOffset,&checksum,sizeof(checksum));
+}
 
-  hopping_assert(packet != 0);
-  hopping_assert(addr != 0);
+//
+// Build the probe packet template for a destination: the IP and
+// ICMP headers with zero TTL, id and sequence number, and with the
+// checksums computed over the whole packet. The payload is the same
+// for all probes.
+//
+
+static void
+hopping_buildprobetemplate(struct hopping_destination* destination,
+			   struct sockaddr_in* sourceAddress) {
   
-  if (sendto (sd, packet, packetLength, 0, addr, sizeof (struct sockaddr)) < 0) {
-    fatalp("sendto() failed");
-  }
+  unsigned int packetLength;
+  char* packet;
+  
+  hopping_assert(destination != 0);
+  hopping_assert(sourceAddress != 0);
+  hopping_assert(probePayload != 0);
   
+  hopping_constructicmp4packet(sourceAddress,
+			       &destination->address,
+			       0,
+			       0,
+			       0,
+			       probePayload,
+			       icmpDataLength,
+			       &packet,
+			       &packetLength);
+  hopping_assert(packetLength == HOPPING_PROBE_HDRLEN + icmpDataLength);
+  memcpy(destination->probeTemplate,packet,HOPPING_PROBE_HDRLEN);
+  destination->probeTemplateBuilt = 1;
 }
 
 //
-// Receive a packet from the raw socket
+// Make the headers for one probe from the destination's template,
+// by patching in the TTL, ids and sequence number and updating the
+// checksums incrementally
 //
 
-static int
-hopping_receivepacket(int sd,
-		      char** result,
-		      int doareadwait,
-		      int doasendwait) {
+static void
+hopping_makeprobeheader(struct hopping_destination* destination,
+			uint16_t id,
+			uint16_t seq,
+			unsigned char ttl,
+			char* header) {
   
-  static char packet[IP_MAXPACKET];
-  struct timeval timeout;
-  struct sockaddr from;
-  socklen_t fromlen;
-  fd_set reads;
-  int selres;
-  int bytes;
+  const unsigned int icmp = HOPPING_IP4_HDRLEN;
+  uint16_t ttlAndProtocol;
   
-  hopping_assert(result != 0);
-  hopping_assert(doareadwait == 0 || doareadwait == 1);
-  hopping_assert(doasendwait == 0 || doasendwait == 1);
+  hopping_assert(destination != 0);
+  hopping_assert(destination->probeTemplateBuilt);
+  hopping_assert(header != 0);
+  
+  memcpy(header,destination->probeTemplate,HOPPING_PROBE_HDRLEN);
   
   //
-  // Perform a select call to wait for
-  // either a timeout or something on the
-  // raw socket
+  // IP header: TTL shares a 16-bit word with the protocol
   //
   
-  timeout.tv_sec = 0;
-  if (doareadwait) {
-    if (doasendwait) {
-      timeout.tv_usec = probePacing % (1000 * 1000);
-      timeout.tv_sec = probePacing / (1000 * 1000);
-    } else {
-      timeout.tv_usec = HOPPING_POLL_SLEEP_US;
-    }
-  } else {
-    timeout.tv_usec = 0;
-  }
-  
-  FD_ZERO(&reads);
-  FD_SET(sd,&reads);
-  debugf("going into select for %lu s %lu us", timeout.tv_sec, timeout.tv_usec);
-  selres = select(1, &reads, 0, 0, &timeout);
+  memcpy(&ttlAndProtocol,header + offsetof(struct ip,ip_ttl),sizeof(ttlAndProtocol));
+  ((unsigned char*)&ttlAndProtocol)[0] = ttl;
+  hopping_patchword(header,
+		    offsetof(struct ip,ip_ttl),
+		    offsetof(struct ip,ip_sum),
+		    ttlAndProtocol);
+  hopping_patchword(header,
+		    offsetof(struct ip,ip_id),
+		    offsetof(struct ip,ip_sum),
+		    id);
   
   //
-  // We have possibly something to receive
-  // (or timeout, in any case, check if there
-  // is something to receive).
+  // ICMP header
   //
+  
+  hopping_patchword(header,
+		    icmp + offsetof(struct icmp,icmp_id),
+		    icmp + offsetof(struct icmp,icmp_cksum),
+		    id);
+  hopping_patchword(header,
+		    icmp + offsetof(struct icmp,icmp_seq),
+		    icmp + offsetof(struct icmp,icmp_cksum),
+		    seq);
+  
+  debugf("made a probe header from template, ttl = %u", ttl);
+}
+
+//
+// Allocate the buffers for the packets that are queued for sending,
+// and make the payload that all probes carry
+//
+
+static void
+hopping_initsendbuffers(void) {
+
+  unsigned int i;
+  
+  probePayload = (char*)malloc(icmpDataLength + 1);
+  if (probePayload == 0) {
+    fatalf("cannot allocate memory for the probe payload");
+  }
+  hopping_fillwithstring(probePayload,HOPPING_PROBE_PAYLOAD,icmpDataLength);
+  
+  memset(sendMessages,0,sizeof(sendMessages));
+  for (i = 0; i < HOPPING_SEND_BATCH; i++) {
+    sendIovecs[i][0].iov_base = sendHeaders[i];
+    sendMessages[i].msg_hdr.msg_iov = sendIovecs[i];
+    sendMessages[i].msg_hdr.msg_iovlen = 2;
+    sendMessages[i].msg_hdr.msg_name = &sendAddresses[i];
+  }
+  nPendingSends = 0;
+}
+
+//
+// Send all queued packets to the raw socket, with as few system calls
+// as possible
+//
+
+static void
+hopping_flushpackets(int sd) {
 
-  bytes = recvfrom(sd,
-		   packet,
-		   sizeof(packet),
-		   MSG_DONTWAIT,
-		   (struct sockaddr*)&from,
-		   &fromlen);
+  unsigned int sent = 0;
   
-  if (bytes < 0 && errno != EAGAIN) {
+  while (sent < nPendingSends) {
     
-    debugf("bytes %u, errno %u", bytes, errno);
-    fatalp("socket() failed to read from the raw socket");
+    int n = sendmmsg(sd,
+		     &sendMessages[sent],
+		     nPendingSends - sent,
+		     0);
     
-  } else if (bytes > 0) {
-  
-    *result = packet;
-    return(bytes);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fatalp("sendmmsg() failed");
+    }
     
-  } else {
-
-    return(0);
+    debugf("sent a batch of %u packets", n);
+    
+    //
+    // Remember which probe each transmit timestamp key
+    // belongs to
+    //
+    
+    while (n-- > 0) {
+      probeStats[sendIds[sent]].transmitKey = transmitKeyCounter;
+      transmitKeys[transmitKeyCounter % HOPPING_TRANSMIT_KEYS] = sendIds[sent];
+      transmitKeyCounter++;
+      sent++;
+    }
     
   }
+  
+  nPendingSends = 0;
 }
 
 //
-// IP & ICMP packet validation
+// Queue a plain IP packet for sending to the raw socket. The packet
+// consists of the headers, which are copied, and the payload, which
+// is not copied and must stay in place until the packet is sent. The
+// queue is sent by hopping_flushpackets(), or here if the queue is
+// full.
 //
 
-static int
-hopping_validatepacket(char* receivedPacket,
-		       int receivedPacketLength,
-		       enum hopping_responseType* responseType,
-		       hopping_idtype* responseId,
-		       unsigned char* responseTtl,
-		       struct ip* responseToIpHdr,
-		       struct icmp* responseToIcmpHdr) {
-
-  uint16_t offset;
-  struct ip iphdr;
-  struct icmp icmphdr;
-
-  //
-  // Check parameters
-  //
+static void
+hopping_sendpacket(int sd,
+		   hopping_idtype id,
+		   char* header,
+		   unsigned int headerLength,
+		   char* payload,
+		   unsigned int payloadLength,
+		   struct sockaddr* addr,
+		   size_t addrLength)  {
 
-  hopping_assert(receivedPacket != 0);
-  hopping_assert(responseType != 0);
-  hopping_assert(responseId != 0);
-  hopping_assert(responseTtl != 0);
-  
-  //
-  // Validate IP4 header
-  //
+  hopping_assert(header != 0);
+  hopping_assert(headerLength <= HOPPING_PROBE_HDRLEN);
+  hopping_assert(payload != 0 || payloadLength == 0);
+  hopping_assert(addr != 0);
+  hopping_assert(addrLength <= sizeof(sendAddresses[0]));
   
-  if (receivedPacketLength < HOPPING_IP4_HDRLEN) {
-    debugf("packet length too small");
-    return(0);
+  if (nPendingSends == HOPPING_SEND_BATCH) {
+    hopping_flushpackets(sd);
   }
   
-  memcpy(&iphdr,receivedPacket,HOPPING_IP4_HDRLEN);
+  sendIds[nPendingSends] = id;
+  memcpy(sendHeaders[nPendingSends],header,headerLength);
+  sendIovecs[nPendingSends][0].iov_len = headerLength;
+  sendIovecs[nPendingSends][1].iov_base = payload;
+  sendIovecs[nPendingSends][1].iov_len = payloadLength;
+  memcpy(&sendAddresses[nPendingSends],addr,addrLength);
+  sendMessages[nPendingSends].msg_hdr.msg_namelen = addrLength;
+  nPendingSends++;
+}
+
+//
+// Allocate the ring of receive buffers. The buffers are large enough
+// for an echo reply to our probes, and for the ICMP errors that quote
+// them.
+//
+
+static void
+hopping_initreceivebuffers(void) {
+
+  unsigned int i;
   
-  if (iphdr.ip_v != 4)  {
-    debugf("version is not 4");
-    return(0);
-  }
+  receiveBufferSize = hopping_max(HOPPING_RECEIVE_BUFFER_MIN,
+				  HOPPING_RECEIVE_BUFFER_SLACK +
+				  HOPPING_IP4_HDRLEN + HOPPING_ICMP4_HDRLEN + icmpDataLength);
+  if (receiveBufferSize > IP_MAXPACKET) receiveBufferSize = IP_MAXPACKET;
   
-  if (ntohs(iphdr.ip_len) > receivedPacketLength) {
-    debugf("claimed packet length larger than received packet length");
-    return(0);
+  receiveBuffers = (char*)malloc(HOPPING_RECEIVE_BATCH * receiveBufferSize);
+  if (receiveBuffers == 0) {
+    fatalf("cannot allocate memory for receive buffers");
   }
-
-  offset = ntohs(iphdr.ip_off);
-  debugf("offset = %x", offset);
-  offset &= (0xFFFF - 0x4000);
-  debugf("offset after adjust = %x", offset);
   
-  if (offset != 0) {
-    debugf("offset not zero");
-    return(0);
+  memset(receiveMessages,0,sizeof(receiveMessages));
+  for (i = 0; i < HOPPING_RECEIVE_BATCH; i++) {
+    receiveIovecs[i].iov_base = receiveBuffers + i * receiveBufferSize;
+    receiveIovecs[i].iov_len = receiveBufferSize;
+    receiveMessages[i].msg_hdr.msg_iov = &receiveIovecs[i];
+    receiveMessages[i].msg_hdr.msg_iovlen = 1;
+    receiveMessages[i].msg_hdr.msg_control = receiveControl[i];
   }
+}
 
-  if (iphdr.ip_p != IPPROTO_ICMP) {
-    debugf("not icmp");
-    return(0);
-  }
+//
+// Find the kernel timestamp of a received message, if there is
+// one. Returns 1 and sets the time if one was found.
+//
 
-  //
-  // What was the TTL of the received packet?
-  // And for some reason, we're getting one higher
-  // TTL than the actual value should be...
-  //
-  
-  *responseTtl = iphdr.ip_ttl;
-  if (*responseTtl > 0) (*responseTtl)--;
+static int
+hopping_getkerneltimestamp(struct msghdr* message,
+			   struct timeval* result) {
 
-  //
-  // IP checksum
-  //
+  struct cmsghdr* cmsg;
   
-  // TODO: check iphdr.ip_sum ...
+  hopping_assert(message != 0);
+  hopping_assert(result != 0);
+  
+  for (cmsg = CMSG_FIRSTHDR(message);
+       cmsg != 0;
+       cmsg = CMSG_NXTHDR(message,cmsg)) {
+    
+    if (cmsg->cmsg_level != SOL_SOCKET) continue;
+    
+    if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      
+      struct timespec kernelTime;
+      memcpy(&kernelTime,CMSG_DATA(cmsg),sizeof(kernelTime));
+      hopping_kerneltimetomonotonic(&kernelTime,result);
+      return(1);
+      
+    } else if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      
+      struct scm_timestamping timestamps;
+      memcpy(&timestamps,CMSG_DATA(cmsg),sizeof(timestamps));
+      if (timestamps.ts[0].tv_sec == 0 && timestamps.ts[0].tv_nsec == 0) continue;
+      hopping_kerneltimetomonotonic(&timestamps.ts[0],result);
+      return(1);
+      
+    }
+    
+  }
+  
+  return(0);
+}
+
+//
+// Attach a socket filter to the input raw socket, so that the kernel
+// drops ICMP packets that are obviously not responses to our probes,
+// instead of copying them to us. The filter accepts echo replies and
+// ICMP errors that quote an echo request sent from our source
+// address, and whose ICMP id falls in the range of our probe ids. If
+// there is only one destination, the quoted echo request must also
+// have been sent to it. The filter uses the same fixed header offsets
+// as hopping_validatepacket(), which still does the complete checks.
+//
+
+static void
+hopping_attachfilter(int rd,
+		     struct sockaddr_in* sourceAddress) {
+
+  //
+  // Offsets of the fields we look at
+  //
+  
+  const unsigned int type = HOPPING_IP4_HDRLEN;
+  const unsigned int id = HOPPING_IP4_HDRLEN + 4;
+  const unsigned int inner = HOPPING_IP4_HDRLEN + HOPPING_ICMP4_HDRLEN;
+  const unsigned int innerProto = inner + 9;
+  const unsigned int innerSource = inner + 12;
+  const unsigned int innerDestination = inner + 16;
+  const unsigned int innerType = inner + HOPPING_IP4_HDRLEN;
+  const unsigned int innerId = inner + HOPPING_IP4_HDRLEN + 4;
+  
+  //
+  // The ICMP id is sent in host byte order, and BPF loads it in
+  // network byte order. Build a mask of the id bits that must be
+  // zero for all our ids.
+  //
+  
+  uint16_t idMask;
+  unsigned int idLimit = 1;
+  
+  struct sock_filter code[] = {
+    /*  0 */ BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, type),
+    /*  1 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   HOPPING_ICMP_ECHOREPLY, 3, 0),
+    /*  2 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   HOPPING_ICMP_TIME_EXCEEDED, 4, 0),
+    /*  3 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   HOPPING_ICMP_DEST_UNREACH, 3, 0),
+    /*  4 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   HOPPING_ICMP_REDIRECT, 2, 13),
+    /*  5 */ BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, id),
+    /*  6 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K,  0, 11, 10),
+    /*  7 */ BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, innerProto),
+    /*  8 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   IPPROTO_ICMP, 0, 9),
+    /*  9 */ BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, innerSource),
+    /* 10 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   0, 0, 7),
+    /* 11 */ BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, innerDestination),
+    /* 12 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   0, 0, 5),
+    /* 13 */ BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS, innerType),
+    /* 14 */ BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,   HOPPING_ICMP_ECHO, 0, 3),
+    /* 15 */ BPF_STMT(BPF_LD  | BPF_H   | BPF_ABS, innerId),
+    /* 16 */ BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K,  0, 1, 0),
+    /* 17 */ BPF_STMT(BPF_RET | BPF_K,             0xFFFFFFFF),
+    /* 18 */ BPF_STMT(BPF_RET | BPF_K,             0)
+  };
+  struct sock_fprog program;
+  
+  hopping_assert(sourceAddress != 0);
+  
+  while (idLimit < probeTableSize && idLimit < 0x10000) idLimit <<= 1;
+  idMask = htons((uint16_t)~(idLimit - 1));
+  code[6].k = idMask;
+  code[16].k = idMask;
+  code[10].k = ntohl(sourceAddress->sin_addr.s_addr);
+  
+  //
+  // With a single destination, check the destination of the
+  // quoted packet. Otherwise skip that check by comparing a
+  // constant to itself.
+  //
+  
+  if (targetsFile == 0 && activeDestinations != 0) {
+    code[12].k = ntohl(activeDestinations->address.sin_addr.s_addr);
+  } else {
+    code[11] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_IMM, 0);
+  }
+  
+  program.len = sizeof(code) / sizeof(code[0]);
+  program.filter = code;
+  
+  if (setsockopt(rd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) < 0) {
+    debugf("cannot attach socket filter (errno %u), filtering only in hopping_validatepacket", errno);
+  }
+}
+
+//
+// Turn on kernel timestamps: receive timestamps on the input socket,
+// and transmit timestamps on the output socket. The transmit
+// timestamps arrive in the error queue of the output socket, each
+// with a key that counts the packets sent on the socket. If the
+// kernel does not support timestamps, we fall back to timestamps
+// taken by ourselves.
+//
+
+static void
+hopping_enablekerneltimestamps(int sd,
+			       int rd) {
+  
+  int on = 1;
+  int flags =
+    SOF_TIMESTAMPING_TX_SOFTWARE |
+    SOF_TIMESTAMPING_SOFTWARE |
+    SOF_TIMESTAMPING_OPT_ID |
+    SOF_TIMESTAMPING_OPT_TSONLY;
+  unsigned int i;
+  
+  if (!kernelTimestamps) return;
+  
+  if (setsockopt(rd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0 ||
+      setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+    debugf("kernel timestamps not available (errno %u), using own timestamps", errno);
+    kernelTimestamps = 0;
+    return;
+  }
+  
+  memset(timestampMessages,0,sizeof(timestampMessages));
+  for (i = 0; i < HOPPING_RECEIVE_BATCH; i++) {
+    timestampMessages[i].msg_hdr.msg_control = timestampControl[i];
+  }
+  transmitKeyCounter = 0;
+}
+
+//
+// Read the transmit timestamps that the kernel has reported for the
+// probes sent so far, and update the probes' send times
+//
+
+static void
+hopping_receivetimestamps(int sd) {
+  
+  int n;
+  int i;
+  
+  if (!kernelTimestamps) return;
+  
+  do {
+    
+    for (i = 0; i < HOPPING_RECEIVE_BATCH; i++) {
+      timestampMessages[i].msg_hdr.msg_controllen = HOPPING_RECEIVE_CONTROL_SIZE;
+      timestampMessages[i].msg_hdr.msg_flags = 0;
+    }
+    
+    n = recvmmsg(sd,
+		 timestampMessages,
+		 HOPPING_RECEIVE_BATCH,
+		 MSG_ERRQUEUE | MSG_DONTWAIT,
+		 0);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR) return;
+      fatalp("recvmmsg() failed to read transmit timestamps");
+    }
+    
+    for (i = 0; i < n; i++) {
+      
+      struct msghdr* message = &timestampMessages[i].msg_hdr;
+      struct sock_extended_err* error = 0;
+      struct hopping_probe* probe;
+      struct timeval sentTime;
+      struct cmsghdr* cmsg;
+      
+      for (cmsg = CMSG_FIRSTHDR(message);
+	   cmsg != 0;
+	   cmsg = CMSG_NXTHDR(message,cmsg)) {
+	if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) {
+	  error = (struct sock_extended_err*)CMSG_DATA(cmsg);
+	}
+      }
+      
+      if (error == 0 ||
+	  error->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ||
+	  !hopping_getkerneltimestamp(message,&sentTime)) {
+	debugf("ignoring an unexpected message in the error queue");
+	continue;
+      }
+      
+      //
+      // Find the probe that was sent with this key. It may
+      // have been freed and reused since, in which case it has
+      // a different key.
+      //
+      
+      probe = &probes[transmitKeys[error->ee_data % HOPPING_TRANSMIT_KEYS]];
+      if (!probe->used ||
+	  hopping_probestats(probe)->transmitKey != error->ee_data ||
+	  hopping_probestats(probe)->kernelSentTime ||
+	  probe->responded) {
+	continue;
+      }
+      
+      hopping_settransmittime(probe,&sentTime);
+      
+    }
+    
+  } while (n == HOPPING_RECEIVE_BATCH);
+}
+
+//
+// Receive a batch of packets from the raw socket, if there are
+// any. The event loop calls this when the socket is readable, so this
+// never waits. Returns the number of packets received, and sets the
+// packets, their lengths and their arrival times in the output
+// arrays.
+//
+
+static int
+hopping_receivepackets(int sd,
+		       char** results,
+		       int* resultLengths,
+		       struct timeval* resultTimes,
+		       int* resultKernelTimes) {
+  
+  struct timeval now;
+  int n;
+  int i;
+  
+  hopping_assert(results != 0);
+  hopping_assert(resultLengths != 0);
+  hopping_assert(resultTimes != 0);
+  hopping_assert(resultKernelTimes != 0);
+  hopping_assert(receiveBuffers != 0);
+  
+  for (i = 0; i < HOPPING_RECEIVE_BATCH; i++) {
+    receiveMessages[i].msg_hdr.msg_controllen = HOPPING_RECEIVE_CONTROL_SIZE;
+    receiveMessages[i].msg_hdr.msg_flags = 0;
+    receiveMessages[i].msg_len = 0;
+  }
+  
+  n = recvmmsg(sd,
+	       receiveMessages,
+	       HOPPING_RECEIVE_BATCH,
+	       MSG_DONTWAIT,
+	       0);
+  
+  if (n < 0 && errno != EAGAIN && errno != EINTR) {
+    
+    debugf("errno %u", errno);
+    fatalp("recvmmsg() failed to read from the raw socket");
+    
+  } else if (n <= 0) {
+
+    return(0);
+    
+  }
+  
+  hopping_getcurrenttime(&now);
+  
+  for (i = 0; i < n; i++) {
+    results[i] = (char*)receiveIovecs[i].iov_base;
+    resultLengths[i] = receiveMessages[i].msg_len;
+    resultKernelTimes[i] =
+      kernelTimestamps &&
+      hopping_getkerneltimestamp(&receiveMessages[i].msg_hdr,&resultTimes[i]);
+    if (!resultKernelTimes[i]) resultTimes[i] = now;
+    if (receiveMessages[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      debugf("received packet was truncated to %u bytes", resultLengths[i]);
+    }
+  }
+  
+  return(n);
+}
+
+//
+// IP & ICMP packet validation
+//
+
+static int
+hopping_validatepacket(char* receivedPacket,
+		       int receivedPacketLength,
+		       enum hopping_responseType* responseType,
+		       uint16_t* responseId,
+		       uint16_t* responseSeq,
+		       unsigned char* responseTtl,
+		       struct ip* responseToIpHdr,
+		       struct icmp* responseToIcmpHdr) {
+
+  uint16_t offset;
+  struct ip iphdr;
+  struct icmp icmphdr;
+
+  //
+  // Check parameters
+  //
+
+  hopping_assert(receivedPacket != 0);
+  hopping_assert(responseType != 0);
+  hopping_assert(responseId != 0);
+  hopping_assert(responseSeq != 0);
+  hopping_assert(responseTtl != 0);
+  
+  //
+  // Validate IP4 header
+  //
+  
+  if (receivedPacketLength < HOPPING_IP4_HDRLEN) {
+    debugf("packet length too small");
+    return(0);
+  }
+  
+  memcpy(&iphdr,receivedPacket,HOPPING_IP4_HDRLEN);
+  
+  if (iphdr.ip_v != 4)  {
+    debugf("version is not 4");
+    return(0);
+  }
+  
+  if (ntohs(iphdr.ip_len) > receivedPacketLength) {
+    debugf("claimed packet length larger than received packet length");
+    return(0);
+  }
+
+  offset = ntohs(iphdr.ip_off);
+  debugf("offset = %x", offset);
+  offset &= (0xFFFF - 0x4000);
+  debugf("offset after adjust = %x", offset);
+  
+  if (offset != 0) {
+    debugf("offset not zero");
+    return(0);
+  }
+
+  if (iphdr.ip_p != IPPROTO_ICMP) {
+    debugf("not icmp");
+    return(0);
+  }
+
+  //
+  // What was the TTL of the received packet?
+  // And for some reason, we're getting one higher
+  // TTL than the actual value should be...
+  //
+  
+  *responseTtl = iphdr.ip_ttl;
+  if (*responseTtl > 0) (*responseTtl)--;
+
+  //
+  // IP checksum
+  //
+  
+  if (iphdr.ip_hl * 4 < HOPPING_IP4_HDRLEN ||
+      iphdr.ip_hl * 4 > receivedPacketLength ||
+      hopping_checksum((uint16_t*)receivedPacket,iphdr.ip_hl * 4) != 0) {
+    debugf("IP header checksum does not match");
+    return(0);
+  }
   
   //
   // Validate ICMP4 header
@@ -1437,8 +3005,18 @@ hopping_validatepacket(char* receivedPacket,
   }
   memcpy(&icmphdr,&receivedPacket[HOPPING_IP4_HDRLEN],HOPPING_ICMP4_HDRLEN);
   *responseId = icmphdr.icmp_id;
+  *responseSeq = icmphdr.icmp_seq;
+  
+  //
+  // ICMP checksum, over the entire ICMP message
+  //
   
-  // TODO: check icmphdr.icmp_sum ...
+  if (ntohs(iphdr.ip_len) < HOPPING_IP4_HDRLEN + HOPPING_ICMP4_HDRLEN ||
+      hopping_checksum((uint16_t*)&receivedPacket[HOPPING_IP4_HDRLEN],
+		       ntohs(iphdr.ip_len) - HOPPING_IP4_HDRLEN) != 0) {
+    debugf("ICMP checksum does not match");
+    return(0);
+  }
 
   switch (icmphdr.icmp_type) {
 
@@ -1465,6 +3043,7 @@ hopping_validatepacket(char* receivedPacket,
 	   &receivedPacket[HOPPING_IP4_HDRLEN+HOPPING_ICMP4_HDRLEN+HOPPING_IP4_HDRLEN],
 	   HOPPING_ICMP4_HDRLEN);
     *responseId = responseToIcmpHdr->icmp_id;
+    *responseSeq = responseToIcmpHdr->icmp_seq;
     debugf("inner header as seen by hopping_validatepacket:");
     debugf("  inner ip proto = %u", responseToIpHdr->ip_p);
     debugf("  inner ip len = %u", ntohs(responseToIpHdr->ip_len));
@@ -1498,6 +3077,7 @@ hopping_validatepacket(char* receivedPacket,
 	   &receivedPacket[HOPPING_IP4_HDRLEN+HOPPING_ICMP4_HDRLEN+HOPPING_IP4_HDRLEN],
 	   HOPPING_ICMP4_HDRLEN);
     *responseId = responseToIcmpHdr->icmp_id;
+    *responseSeq = responseToIcmpHdr->icmp_seq;
     debugf("using inner id %u in ICMP error", *responseId);
     if (responseToIpHdr->ip_p != IPPROTO_ICMP &&
 	responseToIcmpHdr->icmp_type != HOPPING_ICMP_ECHO) {
@@ -1524,6 +3104,7 @@ hopping_validatepacket(char* receivedPacket,
 	   &receivedPacket[HOPPING_IP4_HDRLEN+HOPPING_ICMP4_HDRLEN+HOPPING_IP4_HDRLEN],
 	   HOPPING_ICMP4_HDRLEN);
     *responseId = responseToIcmpHdr->icmp_id;
+    *responseSeq = responseToIcmpHdr->icmp_seq;
     debugf("using inner id %u in ICMP error", *responseId);
     if (responseToIpHdr->ip_p != IPPROTO_ICMP &&
 	responseToIcmpHdr->icmp_type != HOPPING_ICMP_ECHO) {
@@ -1558,7 +3139,7 @@ hopping_packetisforus(char* receivedPacket,
 		      int receivedPacketLength,
 		      enum hopping_responseType receivedResponseType,
 		      struct sockaddr_in* sourceAddress,
-		      struct sockaddr_in* destinationAddress,
+		      struct hopping_destination* destination,
 		      struct ip* responseToIpHdr,
 		      struct icmp* responseToIcmpHdr) {
   
@@ -1570,7 +3151,7 @@ hopping_packetisforus(char* receivedPacket,
 
   hopping_assert(receivedPacket != 0);
   hopping_assert(sourceAddress != 0);
-  hopping_assert(destinationAddress != 0);
+  hopping_assert(destination != 0);
   
   //
   // Check the destination is our source address
@@ -1598,7 +3179,7 @@ hopping_packetisforus(char* receivedPacket,
     debugf("  inner icmp code = %u", responseToIcmpHdr->icmp_code);
     if (memcmp(&responseToIpHdr->ip_src,&sourceAddress->sin_addr,sizeof(responseToIpHdr->ip_src)) != 0) return(0);
     debugf("checking that inner packet in the ICMP error was sent to the destination we are testing");
-    if (memcmp(&responseToIpHdr->ip_dst,&destinationAddress->sin_addr,sizeof(responseToIpHdr->ip_dst)) != 0) return(0);
+    if (memcmp(&responseToIpHdr->ip_dst,&destination->address.sin_addr,sizeof(responseToIpHdr->ip_dst)) != 0) return(0);
     debugf("inner packet checks ok");
     
   }
@@ -1642,7 +3223,8 @@ hopping_reportprogress_sent(hopping_idtype id,
 //
 
 static void
-hopping_reportprogress_received(enum hopping_responseType responseType,
+hopping_reportprogress_received(struct hopping_destination* destination,
+				enum hopping_responseType responseType,
 				hopping_idtype id,
 				unsigned char ttl) {
   
@@ -1674,19 +3256,24 @@ hopping_reportprogress_received(enum hopping_responseType responseType,
       printf(" <--- #%u NO RESPONSE", id);
       break;
       
+    case hopping_responseType_cancelled:
+      printf(" <--- #%u CANCELLED", id);
+      break;
+      
     case hopping_responseType_stillWaiting:
       fatalf("should not have this response type here");
+      break;
       
     default:
       fatalf("invalid response type");
       
     }
     
-    if (progressDetailed) {
-      hopping_reportBriefConclusion();
+    if (progressDetailed && destination != 0) {
+      hopping_reportBriefConclusion(destination);
     }
-    if (progressDetailedProbeStatus) {
-      hopping_reportBriefProbeStatus();
+    if (progressDetailedProbeStatus && destination != 0) {
+      hopping_reportBriefProbeStatus(destination);
     }
       
     lastprogressreportwassentpacket = 0;
@@ -1698,707 +3285,3004 @@ hopping_reportprogress_received(enum hopping_responseType responseType,
 }
 
 //
-// Reporting progress: received other
+// Reporting progress: received other
+//
+
+static void
+hopping_reportprogress_received_other() {
+  
+  if (progress) {
+    printf(" <--- OTHER");
+    lastprogressreportwassentpacket = 0;
+    seenprogressreport = 1;
+    fflush(stdout);
+  }
+  
+}
+
+//
+// Reporting progress: timer on our side fired, considering
+// retransmission for the probe
+//
+
+static void
+hopping_reportprogress_retransmissionconsidered(struct hopping_destination* destination,
+						hopping_idtype id,
+						unsigned char ttl) {
+  
+  hopping_reportprogress_received(destination,
+				  hopping_responseType_retransmissionConsidered,
+				  id,
+				  ttl);
+}
+
+//
+// Reporting progress: received nothing
+//
+
+static void
+hopping_reportprogress_noresponse(struct hopping_destination* destination,
+				  hopping_idtype id,
+				  unsigned char ttl) {
+  
+  hopping_reportprogress_received(destination,
+				  hopping_responseType_noResponse,
+				  id,
+				  ttl);
+}
+
+//
+// Reporting progress: done
+//
+
+static void
+hopping_reportprogress_end() {
+  
+  if (progress) {
+    if (seenprogressreport) {
+      printf("\n");
+    }
+  }
+  
+}
+
+//
+// Search for what probes in a given TTL range
+// have not been sent yet
+//
+
+static unsigned int
+hopping_probesnotyetsentinrange(struct hopping_destination* destination,
+				unsigned char minTtlValue,
+				unsigned char maxTtlValue) {
+  return(hopping_countprobes_notsentinrange(destination,minTtlValue,maxTtlValue));
+}
+
+//
+// Can and should we continue the probing?
+//
+
+static int
+hopping_shouldcontinuesending(struct hopping_destination* destination) {
+  if (interrupt) return(0);
+  if (destination->probesSent >= maxProbes) return(0);
+  if (hopping_deadline_passed(destination)) return(0);
+  if (hopping_searchdone(destination)) return(0);
+  if (!hopping_probesnotyetsentinrange(destination,
+				       destination->hopsMinInclusive,
+				       destination->hopsMaxInclusive)) return(0);
+  return(1);
+}
+
+//
+// Has the range been narrowed enough: to one hop count, or with
+// -tolerance k, to at most 2k+1 hop counts?
+//
+
+static int
+hopping_searchdone(struct hopping_destination* destination) {
+  hopping_assert(destination != 0);
+  return((unsigned int)destination->hopsMaxInclusive - destination->hopsMinInclusive <= 2 * tolerance);
+}
+
+//
+// Can and should we continue the probing or waiting for responses to
+// the probes already sent?
+//
+
+static int
+hopping_shouldcontinuesendingorwaiting(struct hopping_destination* destination) {
+  struct timeval now;
+  
+  if (interrupt) return(0);
+  if (hopping_searchdone(destination)) return(0);
+  if (hopping_deadline_passed(destination)) return(0);
+  if (hopping_waitingforresponses(destination) > 0) return(1);
+  
+  hopping_getcurrenttime(&now);
+  if (destination->startTime.tv_sec + maxWait < now.tv_sec) return(0);
+  
+  return(hopping_shouldcontinuesending(destination));
+}
+
+//
+// Retransmit a given probe (by creating a new probe)
+//
+
+static void
+hopping_retransmitactiveprobe(int sd,
+			      struct hopping_destination* destination,
+			      struct sockaddr_in* sourceAddress,
+			      struct hopping_probe* probe) {
+
+  unsigned int expectedLen = HOPPING_IP4_HDRLEN + HOPPING_ICMP4_HDRLEN + icmpDataLength;
+  hopping_idtype id = hopping_getnewid(probe->hops);
+  struct hopping_probe* newProbe;
+
+  hopping_assert(destination != 0);
+  hopping_assert(sourceAddress != 0);
+  hopping_assert(probe != 0);
+  
+  debugf("retransmitting probe id %u ttl %u", probe->id, probe->hops);
+  
+  newProbe = hopping_newprobe(destination,id,probe->hops,expectedLen,probe);
+  if (probe == 0) {
+    fatalf("cannot allocate a new probe entry");
+  }
+
+  //
+  // Send it
+  //
+  
+  hopping_sendprobeaux(sd,
+		       destination,
+		       sourceAddress,
+		       expectedLen,
+		       newProbe);
+  
+  //
+  // Report progress on screen
+  //
+  
+  hopping_reportprogress_sent(id,newProbe->hops,1);
+  hopping_redundancy_schedule(destination,newProbe);
+}
+
+//
+// Mark a probe and its predecessors as timed out
+//
+
+static void
+hopping_markprobe_astimedout(struct hopping_probe* probe) {
+  struct hopping_probe* previous;
+  hopping_assert(probe != 0);
+  debugf("hopping_markprobe_astimedout probe id %u ttl %u responsetype %u noresponse %u",
+	 probe->id, probe->hops, probe->responseType, hopping_responseType_noResponse);
+  hopping_assert(probe->responseType == hopping_responseType_stillWaiting);
+  hopping_setprobestate(probe,probe->responded,hopping_responseType_noResponse);
+  previous = hopping_probestats(probe)->previousTransmission;
+  if (previous != 0 &&
+      previous->responseType != hopping_responseType_noResponse) {
+    debugf("recursing from probe %u to %u", probe->id, previous->id);
+    hopping_markprobe_astimedout(previous);
+  }
+}
+
+//
+// The timer of a probe has expired: decide whether to retransmit it,
+// send a new probe instead, or give up on the probe
+//
+
+static void
+hopping_probetimeout(int sd,
+		     struct sockaddr_in* sourceAddress,
+		     struct hopping_probe* probe) {
+
+  struct hopping_destination* destination;
+  unsigned int triesSoFar;
+  
+  hopping_assert(sourceAddress != 0);
+  hopping_assert(probe != 0);
+  hopping_assert(probe->used);
+  destination = probe->destination;
+  hopping_assert(destination != 0);
+  
+  //
+  // This probe has not seen an answer yet, nor is there an ongoing
+  // retranmission for it yet (otherwise its timer would not have been
+  // running).
+  //
+  
+  hopping_assert(!probe->responded &&
+		 probe->nextRetransmission == 0 &&
+		 probe->responseType != hopping_responseType_noResponse);
+  
+  //
+  // Timeout has passed. But should we retranmsit or rather
+  // send a new probe (if an additional new probe would bring
+  // new information)?
+  //
+  // And have we sent too many retries already?
+  //
+  
+  if (probe->speculative || probe->redundant) {
+    debugf("%s probe id %u ttl %u timed out",
+	   probe->speculative ? "speculative" : "redundant",
+	   probe->id, probe->hops);
+    hopping_reportprogress_noresponse(destination,probe->id,probe->hops);
+    hopping_markprobe_astimedout(probe);
+    return;
+  }
+  
+  triesSoFar = hopping_retries(probe);
+  debugf("Considering new retransmission of probe TTL %u, triesSoFar = %u, maxTries = %u",
+	 probe->hops,
+	 triesSoFar,
+	 maxTries);
+  
+  if (hopping_probestats(probe)->newProbeSentInsteadOfRetransmission == 0&&
+      !preferRetransmissionsOverNewProbes &&
+      hopping_probesnotyetsentinrange(destination,
+				      destination->hopsMinInclusive,
+				      destination->hopsMaxInclusive) &&
+      hopping_shouldcontinuesending(destination) &&
+      destination->probesSent < maxProbes) {
+    
+    //
+    // There are more useful new probes to send. Send one.
+    //
+    
+    debugf("preferring new probe over retransmission of probe id %u ttl %u",
+	   probe->id, probe->hops);
+    hopping_reportprogress_retransmissionconsidered(destination,probe->id,probe->hops);
+    hopping_probestats(probe)->newProbeSentInsteadOfRetransmission =
+      hopping_sendprobe(sd,destination,sourceAddress,0);
+    
+    //
+    // Increase the current probe's timeout per exponential
+    // backoff rules.
+    //
+    
+    hopping_setprobetimeout(probe,
+			    hopping_probestats(probe)->timeoutUSecs *
+			    HOPPING_RETRANSMISSION_BACKOFF_FACTOR);
+    hopping_timer_arm(probe);
+    
+  } else if (triesSoFar >= maxTries ||
+	     destination->probesSent >= maxProbes) {
+    
+    //
+    // Bailing out, have attempted to send too many
+    // packets with this TTL already.
+    //
+    
+    debugf("bailout, about to call reportprogress");
+    hopping_reportprogress_noresponse(destination,probe->id,probe->hops);
+    debugf("bailout, about to call astimedout");
+    hopping_markprobe_astimedout(probe);
+    if (algorithm == hopping_algorithms_bayes) {
+      hopping_bayes_observe(destination,probe->hops,hopping_responseType_noResponse,0,triesSoFar);
+    }
+    debugf("bailout, about to allow a new task to continue");
+    hopping_bucket_releasetask(destination);
+    hopping_canceluselessprobes(destination);
+    debugf("bailout, about to exit");
+    
+  } else {
+    
+    //
+    // Ok. Request a retranmission to be sent...
+    //
+    
+    hopping_reportprogress_retransmissionconsidered(destination,probe->id,probe->hops);
+    hopping_retransmitactiveprobe(sd,
+				  destination,
+				  sourceAddress,
+				  probe);
+    hopping_setprobestate(probe,probe->responded,hopping_responseType_noResponse);
+    
+  }
+  
+}
+
+//
+// Retransmit (or give up on) the currently active (not responded to)
+// probes whose timers have expired
+//
+
+static void
+hopping_retransmitactiveprobes(int sd,
+			       struct sockaddr_in* sourceAddress) {
+
+  struct hopping_probe* expired;
+  struct timeval now;
+  
+  hopping_assert(sourceAddress != 0);
+  
+  //
+  // Get current time, and the probes whose timeouts have passed
+  //
+  
+  hopping_getcurrenttime(&now);
+  expired = hopping_timer_expire(&now);
+  
+  //
+  // Handle each of them
+  //
+  
+  while (expired != 0) {
+    
+    struct hopping_probe* probe = expired;
+    expired = probe->timerNext;
+    probe->timerNext = 0;
+    hopping_probetimeout(sd,sourceAddress,probe);
+    
+  }
+  
+}
+
+//
+// Construct and send a packet for a newly allocated probe
+//
+
+static void
+hopping_sendprobeaux(int sd,
+		     struct hopping_destination* destination,
+		     struct sockaddr_in* sourceAddress,
+		     unsigned int expectedLen,
+		     struct hopping_probe* probe) {
+  
+  char header[HOPPING_PROBE_HDRLEN];
+  
+  hopping_assert(destination != 0);
+  hopping_assert(sourceAddress != 0);
+  hopping_assert(probe != 0);
+  
+  //
+  // Create the packet headers from the destination's template
+  //
+  
+  if (!destination->probeTemplateBuilt) {
+    hopping_buildprobetemplate(destination,sourceAddress);
+  }
+  if (expectedLen != HOPPING_PROBE_HDRLEN + icmpDataLength) {
+    fatalf("expected and resulting packet lengths do not agree (%u vs. %u)",
+	   expectedLen, HOPPING_PROBE_HDRLEN + icmpDataLength);
+  }
+  hopping_makeprobeheader(destination,
+			  hopping_probewireid(probe->id),
+			  hopping_probewireseq(probe->id),
+			  probe->hops,
+			  header);
+  
+  //
+  // Send the packet
+  //
+  
+  hopping_sendpacket(sd,
+		     probe->id,
+		     header,
+		     HOPPING_PROBE_HDRLEN,
+		     probePayload,
+		     icmpDataLength,
+		     (struct sockaddr *)&destination->address,
+		     sizeof (struct sockaddr));
+}
+
+//
+// Get a likely number of hops value for binary search
+// start value, instead of blindly selecting 128 as the
+// middle of the theoretical field. The 128 value is
+// unlikely to be a real max TTL value in most cases.
+//
+
+static unsigned char
+hopping_bestinitialguess(unsigned char from,
+			 unsigned char to) {
+  unsigned char selected = HOPPING_TYPICAL_INTERNET_HOP_COUNT + 1;
+  if (selected < from) selected = from;
+  if (selected > to) selected = to;
+  return(selected);
+}
+  
+//
+// Get a likely number of hops value for binary search
+// start value, for probes that are not the first probe
+// but when we have not yet received any responses, so
+// there is no knowledge of the search space reducing at
+// all yet.
+//
+
+static unsigned char
+hopping_bestinitialotherguess(struct hopping_destination* destination,
+			      unsigned char from,
+			      unsigned char to,
+			      unsigned int numberOfTests) {
+  return(hopping_bestbinarysearchvalue(destination,
+				       HOPPING_TYPICAL_INTERNET_MIN_HOP_COUNT,
+				       HOPPING_TYPICAL_INTERNET_MAX_HOP_COUNT,
+				       numberOfTests));
+}
+  
+//
+// Get a new search value in the possible range of values,
+// based on binary (or tertiary or ...) search algorithm.
+// The candidates are the TTLs in the range from..to that
+// have not yet been probed.
+//
+// With -tolerance k, the search ends at a range of 2k+1 hop counts
+// rather than one. The split is then moved to the nearest multiple
+// of 2k+1 hop counts from the start of the range, so that the
+// ranges it leaves are made of whole final ranges. For instance,
+// with k = 1, 9 hop counts split in 3 and 6 rather than 4 and 5:
+// after 4 or 5 the search would need two more probes, after 3 or 6
+// at most one.
+//
+
+static unsigned char
+hopping_bestbinarysearchvalue(struct hopping_destination* destination,
+			      unsigned char from,
+			      unsigned char to,
+			      unsigned int numberOfTests) {
+  
+  unsigned char ttl;
+  unsigned int width;
+  unsigned int below;
+  unsigned int aligned;
+  
+  hopping_assert(numberOfTests > 0);
+  ttl = hopping_searchquantile(destination,from,to,1,numberOfTests + 1);
+  if (tolerance == 0 || from >= to) return(ttl);
+  
+  width = 2 * tolerance + 1;
+  below = (unsigned int)ttl - from + 1;
+  below = hopping_max((below + width / 2) / width,1) * width;
+  aligned = hopping_min((unsigned int)from + below - 1,(unsigned int)to - 1);
+  if (hopping_ttlinset(destination->ttlsProbed,aligned)) return(ttl);
+  
+  debugf("tolerance %u moves the split in %u..%u from %u to %u", tolerance, from, to, ttl, aligned);
+  return((unsigned char)aligned);
+}
+
+//
+// Find the TTL at which a given share (part/parts) of the candidate
+// hop counts in from..to lies below, not counting the TTLs that have
+// already been probed. The share is of the probability mass of the
+// candidates, or of their number with -plain-distribution.
+//
+
+static unsigned char
+hopping_searchquantile(struct hopping_destination* destination,
+		       unsigned char from,
+		       unsigned char to,
+		       unsigned int part,
+		       unsigned int parts) {
+  
+  unsigned int nAvailable;
+  unsigned char candidate;
+
+  //
+  // Sanity tests
+  //
+
+  debugf("hopping_searchquantile start %u..%u, %u/%u", from, to, part, parts);
+  hopping_assert(destination != 0);
+  hopping_assert(from <= to);
+  hopping_assert(part > 0 && part < parts);
+  
+  //
+  // First, count the items in the range from..to that have
+  // not been probed
+  //
+  
+  nAvailable = (unsigned int)to - from + 1 - hopping_countprobes_sentinrange(destination,from,to);
+  debugf("navailable finally %u", nAvailable);
+  hopping_assert(nAvailable > 0);
+  
+  //
+  // Then, figure out what items in the list deserve to be
+  // picked, based on how many tests we have available.
+  // For instance, with one test available we would halve
+  // the search space, with two we divide it to three,
+  // with three divide to four, etc.
+  //
+
+  if (probabilisticDistribution) {
+
+    //
+    // Probabilistic distribution based on likelihoods of different hop counts
+    //
+    
+    double candidateProbabilityPosition = (double)part / (double)parts;
+    debugf("hopping_searchquantile candidate probability %f navailable %u",
+	   candidateProbabilityPosition,
+	   nAvailable);
+    hopping_assert(candidateProbabilityPosition >= -0.01);
+    hopping_assert(candidateProbabilityPosition <=  1.01);
+    candidate = hopping_selectfromdistribution(candidateProbabilityPosition,
+					       from,
+					       to,
+					       destination->ttlsProbed);
+    
+  } else {
+    
+    //
+    // Plain distribution based on actual numbers
+    //
+    
+    unsigned int candidateIndex = (part * nAvailable) / parts;
+    unsigned int ttl;
+    debugf("hopping_searchquantile candidate %u navailable %u",
+	   candidateIndex,
+	   nAvailable);
+    hopping_assert(candidateIndex < nAvailable);
+    for (ttl = from; ; ttl++) {
+      hopping_assert(ttl <= to);
+      if (hopping_ttlinset(destination->ttlsProbed,ttl)) continue;
+      if (candidateIndex-- == 0) break;
+    }
+    candidate = (unsigned char)ttl;
+    
+  }
+  
+  debugf("binary search picks candidate %u from a pool of %u available candidates (quantile %u/%u)",
+	 candidate, nAvailable, part, parts);
+  
+  //
+  // Done. Return the candidate
+  //
+  
+  return(candidate);
+}
+
+//
+// Parallel rounds ------------------------------------------------------------
+//
+// With binary search and -parallel k, k > 1, the probes are sent in
+// rounds. A round is planned as a whole when the previous one has
+// been resolved, i.e., no probe is waiting for a response any more:
+// its TTLs are the k-quantiles of the candidate hop counts, so that
+// the k probes together split the range in k+1 parts of equal
+// probability. The round is sent as one burst. Thanks to the
+// cancellation of probes that a response makes useless, a round is
+// resolved as soon as its responses have pinned the hop count to one
+// of the parts. The number of rounds is then about log(range) with
+// base k+1.
+//
+
+//
+// Is the search done in rounds?
+//
+
+static int
+hopping_round_inuse(void) {
+  return(algorithm == hopping_algorithms_binarysearch && parallel > 1);
+}
+
+//
+// Would a probe with a given TTL still narrow the range?
+//
+
+static int
+hopping_round_useful(struct hopping_destination* destination,
+		     unsigned int ttl) {
+  hopping_assert(destination != 0);
+  return(ttl >= destination->hopsMinInclusive &&
+	 ttl < destination->hopsMaxInclusive &&
+	 !hopping_ttlinset(destination->ttlsProbed,ttl));
+}
+
+//
+// Take the next TTL of the current round's plan. Returns 0 if the
+// plan has no useful TTLs left.
+//
+
+static unsigned char
+hopping_round_next(struct hopping_destination* destination) {
+  
+  unsigned int ttl;
+  
+  hopping_assert(destination != 0);
+  
+  for (ttl = destination->hopsMinInclusive; ttl < destination->hopsMaxInclusive; ttl++) {
+    if (!hopping_ttlinset(destination->roundPlan,ttl)) continue;
+    destination->roundPlan[ttl / 64] &= ~(1ULL << (ttl % 64));
+    if (hopping_round_useful(destination,ttl)) return((unsigned char)ttl);
+  }
+  memset(destination->roundPlan,0,sizeof(destination->roundPlan));
+  return(0);
+}
+
+//
+// May new probes be sent now: either the current round still has
+// TTLs to send, or it has been resolved and a new one can be
+// planned
+//
+
+static int
+hopping_round_cansend(struct hopping_destination* destination) {
+  
+  unsigned int ttl;
+  
+  hopping_assert(destination != 0);
+  
+  if (!hopping_round_inuse()) return(1);
+  if (hopping_waitingforresponses(destination) == 0) return(1);
+  for (ttl = destination->hopsMinInclusive; ttl < destination->hopsMaxInclusive; ttl++) {
+    if (hopping_ttlinset(destination->roundPlan,ttl) &&
+	hopping_round_useful(destination,ttl)) return(1);
+  }
+  return(0);
+}
+
+//
+// The weight of the hop counts within from..to (inclusive) when
+// splitting a round: their probability mass, or with
+// -plain-distribution, their number
+//
+
+static double
+hopping_round_mass(unsigned int from,
+		   unsigned int to) {
+  if (from > to) return(0.0);
+  if (probabilisticDistribution) {
+    return(hopping_distributionmass((unsigned char)from,(unsigned char)to));
+  } else {
+    return((double)(to - from + 1));
+  }
+}
+
+//
+// Add to the plan the free TTL (within from..to, not probed, not yet
+// planned) that best splits the heaviest part of the range left
+// between the planned TTLs. Returns 0 if there are no free TTLs.
+//
+
+static unsigned char
+hopping_round_refill(struct hopping_destination* destination,
+		     unsigned int from,
+		     unsigned int to) {
+  
+  unsigned int segmentFrom = destination->hopsMinInclusive;
+  unsigned int bestFrom = 0;
+  unsigned int bestTo = 0;
+  double bestMass = -1.0;
+  double bestBalance = 0.0;
+  unsigned char best = 0;
+  unsigned int ttl;
+  
+  //
+  // Find the heaviest part of the range that has free TTLs. The
+  // parts are bounded by the planned TTLs: a probe at ttl separates
+  // the hop counts up to ttl from those above it.
+  //
+  
+  for (ttl = destination->hopsMinInclusive; ttl <= destination->hopsMaxInclusive; ttl++) {
+    
+    unsigned int candidate;
+    int hasfree = 0;
+    double mass;
+    
+    if (ttl < destination->hopsMaxInclusive &&
+	!hopping_ttlinset(destination->roundPlan,ttl)) continue;
+    for (candidate = hopping_max(segmentFrom,from);
+	 candidate < ttl && candidate <= to && !hasfree;
+	 candidate++) {
+      hasfree = (hopping_round_useful(destination,candidate) &&
+		 !hopping_ttlinset(destination->roundPlan,candidate));
+    }
+    mass = hopping_round_mass(segmentFrom,ttl);
+    if (hasfree && mass > bestMass) {
+      bestMass = mass;
+      bestFrom = segmentFrom;
+      bestTo = ttl;
+    }
+    segmentFrom = ttl + 1;
+    
+  }
+  if (bestMass < 0.0) return(0);
+  
+  //
+  // Split that part as evenly as the free TTLs allow
+  //
+  
+  for (ttl = hopping_max(bestFrom,from); ttl < bestTo && ttl <= to; ttl++) {
+    double balance;
+    if (!hopping_round_useful(destination,ttl) ||
+	hopping_ttlinset(destination->roundPlan,ttl)) continue;
+    balance = fabs(hopping_round_mass(bestFrom,ttl) - hopping_round_mass(ttl + 1,bestTo));
+    if (best == 0 || balance < bestBalance) {
+      best = (unsigned char)ttl;
+      bestBalance = balance;
+    }
+  }
+  
+  hopping_assert(best != 0);
+  destination->roundPlan[best / 64] |= (1ULL << (best % 64));
+  return(best);
+}
+
+//
+// Plan a new round of up to the given number of probes. The TTLs
+// are the quantiles of the candidates not yet probed, refilled up to
+// the round size so that every probe is for a different useful TTL.
+//
+
+static void
+hopping_round_plan(struct hopping_destination* destination,
+		   unsigned int probes) {
+  
+  unsigned int from = destination->hopsMinInclusive;
+  unsigned int to = destination->hopsMaxInclusive - 1;
+  unsigned int available;
+  unsigned int likely = 0;
+  unsigned int planned = 0;
+  unsigned int i;
+  
+  hopping_assert(destination != 0);
+  hopping_assert(probes > 0);
+  
+  memset(destination->roundPlan,0,sizeof(destination->roundPlan));
+  if (destination->hopsMinInclusive >= destination->hopsMaxInclusive) return;
+  
+  //
+  // Cap the round at the number of TTLs left to probe
+  //
+  
+  available = hopping_countprobes_notsentinrange(destination,from,to);
+  if (probes > available) probes = available;
+  if (probes == 0) return;
+  
+  //
+  // If nothing is known yet, the first few probes go to the likely
+  // hop counts like the initial guesses of the per-probe search,
+  // starting from the usual initial guess
+  //
+  
+  if (likelyCandidates &&
+      hopping_responses(destination) == 0 &&
+      destination->probesSent < HOPPING_N_TYPICAL_HOP_COUNT_TRIES) {
+    unsigned int likelyFrom = hopping_max(from,HOPPING_TYPICAL_INTERNET_MIN_HOP_COUNT);
+    unsigned int likelyTo = hopping_min(to,HOPPING_TYPICAL_INTERNET_MAX_HOP_COUNT);
+    if (likelyFrom <= likelyTo) {
+      likely = hopping_min(probes,HOPPING_N_TYPICAL_HOP_COUNT_TRIES - destination->probesSent);
+      if (destination->probesSent == 0) {
+	unsigned char guess = hopping_bestinitialguess(from,to);
+	destination->roundPlan[guess / 64] |= (1ULL << (guess % 64));
+	planned++;
+      }
+      while (planned < likely &&
+	     hopping_round_refill(destination,likelyFrom,likelyTo) != 0) planned++;
+    }
+  }
+  
+  //
+  // Otherwise start from the quantiles. Those that coincide, or
+  // fall on a TTL that would not narrow the range, are left out.
+  //
+  
+  if (likely == 0) {
+    for (i = 1; i <= probes; i++) {
+      unsigned char ttl = hopping_searchquantile(destination,from,to,i,probes + 1);
+      if (!hopping_round_useful(destination,ttl) ||
+	  hopping_ttlinset(destination->roundPlan,ttl)) continue;
+      destination->roundPlan[ttl / 64] |= (1ULL << (ttl % 64));
+      planned++;
+    }
+  }
+  
+  //
+  // Fill the round up to its size
+  //
+  
+  while (planned < probes && hopping_round_refill(destination,from,to) != 0) planned++;
+  
+  destination->rounds++;
+  debugf("planned round %u of %u probes in %u..%u",
+	 destination->rounds, planned, from, to);
+}
+
+//
+// Choose the TTL for the next probe in the current round, planning a
+// new round if the previous one is resolved. Probes sent outside the
+// bucket (instead of retransmissions) are not part of the round.
+//
+
+static unsigned char
+hopping_round_select(struct hopping_destination* destination,
+		     int inbucket) {
+  
+  unsigned char ttl;
+  
+  hopping_assert(destination != 0);
+  
+  if (inbucket) {
+    if ((ttl = hopping_round_next(destination)) != 0) return(ttl);
+    if (hopping_waitingforresponses(destination) == 0) {
+      if (deadlineMs > 0) {
+	hopping_bucket_initialize(destination,hopping_deadline_roundsize(destination));
+      }
+      hopping_round_plan(destination,destination->bucket);
+      if ((ttl = hopping_round_next(destination)) != 0) return(ttl);
+    }
+  }
+  
+  return(hopping_bestbinarysearchvalue(destination,
+				       destination->hopsMinInclusive,
+				       destination->hopsMaxInclusive,
+				       1));
+}
+
+//
+// Deadlines ------------------------------------------------------------------
+//
+// With -deadline ms, each destination has that many milliseconds
+// from its start to find the hop count. When the time is up, the
+// search ends with whatever range it has learned, and the result
+// gives the most likely hop count within it (see
+// hopping_estimate). With binary search and -parallel k, k > 1, the
+// rounds of parallel probes are then sized by the time that is left:
+// if about R round trips still fit before the deadline and there are
+// w candidate hop counts, a round needs k probes where (k+1)^R >= w
+// to pin down the hop count in time. Fewer round trips left means
+// larger rounds, up to -parallel probes. Until there is an RTT
+// sample, a round trip is taken to last the initial retransmission
+// timeout.
+//
+
+//
+// Has the deadline of a destination passed?
+//
+
+static int
+hopping_deadline_passed(struct hopping_destination* destination) {
+  
+  struct timeval now;
+  
+  hopping_assert(destination != 0);
+  
+  if (deadlineMs == 0) return(0);
+  hopping_getcurrenttime(&now);
+  return(!hopping_timeisless(&now,&destination->deadline));
+}
+
+//
+// The number of probes for the next round, given the time left
+//
+
+static unsigned int
+hopping_deadline_roundsize(struct hopping_destination* destination) {
+  
+  struct timeval now;
+  unsigned long long left;
+  unsigned long long roundTime;
+  unsigned int roundsLeft;
+  unsigned int width;
+  unsigned int probes;
+  
+  hopping_assert(destination != 0);
+  
+  hopping_getcurrenttime(&now);
+  left = (hopping_timeisless(&now,&destination->deadline) ?
+	  hopping_timediffinusecs(&destination->deadline,&now) : 0);
+  roundTime = (destination->rtt.samples > 0 ?
+	       hopping_max(destination->rtt.srttUSecs,1) :
+	       hopping_rtt_initialtimeout(destination,destination->hopsMinInclusive));
+  roundsLeft = (unsigned int)hopping_max(left / roundTime,1);
+  width = (unsigned int)destination->hopsMaxInclusive - destination->hopsMinInclusive + 1;
+  
+  probes = (unsigned int)ceil(pow((double)width,1.0 / roundsLeft) - 0.000001) - 1;
+  probes = hopping_min(probes,parallel);
+  if (destination->probesSent < maxProbes) {
+    probes = hopping_min(probes,maxProbes - destination->probesSent);
+  }
+  probes = hopping_max(probes,1);
+  
+  debugf("%llu us and about %u round trips left for %u candidates, round of %u probes",
+	 left, roundsLeft, width, probes);
+  return(probes);
+}
+
+//
+// The most likely hop count in the current range, and its
+// probability: from the posterior with the bayes algorithm, and
+// otherwise from the hop count distribution restricted to the range.
+// Returns 0 if all the hop counts in the range are equally likely,
+// as they are with -plain-distribution, so that none is the most
+// likely.
+//
+
+static int
+hopping_estimate(struct hopping_destination* destination,
+		 unsigned char* hops,
+		 double* confidence) {
+  
+  unsigned int h;
+  double sum = 0.0;
+  double best = -1.0;
+  double worst = -1.0;
+  
+  hopping_assert(destination != 0);
+  hopping_assert(hops != 0);
+  hopping_assert(confidence != 0);
+  
+  *hops = destination->hopsMinInclusive;
+  for (h = destination->hopsMinInclusive; h <= destination->hopsMaxInclusive; h++) {
+    double weight;
+    if (algorithm == hopping_algorithms_bayes) weight = destination->posterior[h];
+    else if (probabilisticDistribution) weight = hopsprobabilitydistribution[h];
+    else weight = 1.0;
+    sum += weight;
+    if (weight > best) {
+      best = weight;
+      *hops = (unsigned char)h;
+    }
+    if (worst < 0.0 || weight < worst) worst = weight;
+  }
+  
+  *confidence = (sum > 0.0 ?
+		 best / sum :
+		 1.0 / ((unsigned int)destination->hopsMaxInclusive - destination->hopsMinInclusive + 1));
+  return(best > worst);
+}
+
+//
+// Bayesian search ------------------------------------------------------------
+//
+// With -algorithm bayes, each destination keeps a posterior
+// distribution of its hop count over 1..255. It starts from the hop
+// count distribution (built-in or learned), restricted to the
+// current range, and is multiplied by the likelihood of every
+// response (or final lack of one):
+//
+//   - An ECHO REPLY to TTL t means the hop count is at most t, and
+//     at most 256 minus the TTL of the reply.
+//   - A TIME EXCEEDED to TTL t means the hop count is above t.
+//   - No response after n tries is likely if the hop count is above
+//     t and the router at t is silent (-bayes-silence), and
+//     unlikely otherwise, as all n probes would have to be lost.
+//
+// Responses contradict the above with probability
+// HOPPING_BAYES_ERROR, so a single contradictory response does not
+// zero out the posterior as it does the min..max range. The search
+// stops when the most likely hop count has -bayes-confidence of the
+// posterior mass.
+//
+
+//
+// Set the posterior to the prior over the current range
+//
+
+static void
+hopping_bayes_initialize(struct hopping_destination* destination) {
+
+  double sum = 0.0;
+  unsigned int h;
+  
+  hopping_assert(destination != 0);
+  
+  for (h = 0; h < 256; h++) {
+    if (h >= destination->hopsMinInclusive && h <= destination->hopsMaxInclusive) {
+      destination->posterior[h] = hopsprobabilitydistribution[h];
+      sum += destination->posterior[h];
+    } else {
+      destination->posterior[h] = 0.0;
+    }
+  }
+  
+  hopping_assert(sum > 0.0);
+  for (h = 0; h < 256; h++) {
+    destination->posterior[h] /= sum;
+  }
+}
+
+//
+// Update the posterior with a response of the given type to a probe
+// with the given TTL. If the most likely hop count has become likely
+// enough, the search range collapses to it, which ends the search.
+//
+
+static void
+hopping_bayes_observe(struct hopping_destination* destination,
+		      unsigned char ttl,
+		      enum hopping_responseType type,
+		      unsigned char responseTtl,
+		      unsigned int tries) {
+  
+  double lost = pow(HOPPING_BAYES_LOSS,tries);
+  double below;
+  double above;
+  double sum = 0.0;
+  double best = 0.0;
+  unsigned int bestHops = 0;
+  unsigned int h;
+  
+  hopping_assert(destination != 0);
+  
+  //
+  // Likelihoods of the response for hop counts at most ttl
+  // (below) and above ttl (above)
+  //
+  
+  switch (type) {
+  case hopping_responseType_echoResponse:
+    below = 1.0 - HOPPING_BAYES_ERROR;
+    above = HOPPING_BAYES_ERROR;
+    break;
+  case hopping_responseType_timeExceeded:
+    below = HOPPING_BAYES_ERROR;
+    above = 1.0 - HOPPING_BAYES_ERROR;
+    break;
+  case hopping_responseType_noResponse:
+    below = lost;
+    above = bayesSilence + (1.0 - bayesSilence) * lost;
+    break;
+  default:
+    return;
+  }
+  
+  for (h = 1; h < 256; h++) {
+    double likelihood = (h <= ttl) ? below : above;
+    if (type == hopping_responseType_echoResponse &&
+	h > 256 - (unsigned int)responseTtl) {
+      likelihood *= HOPPING_BAYES_ERROR;
+    }
+    destination->posterior[h] *= likelihood;
+    sum += destination->posterior[h];
+  }
+  
+  hopping_assert(sum > 0.0);
+  for (h = 1; h < 256; h++) {
+    destination->posterior[h] /= sum;
+    if (destination->posterior[h] > best) {
+      best = destination->posterior[h];
+      bestHops = h;
+    }
+  }
+  
+  debugf("posterior after %s on ttl %u: most likely %u hops with probability %f",
+	 hopping_responseTypeToString(type), ttl, bestHops, best);
+  
+  if (best >= bayesConfidence &&
+      bestHops >= destination->hopsMinInclusive &&
+      bestHops <= destination->hopsMaxInclusive) {
+    debugf("bayes search concludes %u hops", bestHops);
+    destination->hopsMinInclusive = bestHops;
+    destination->hopsMaxInclusive = bestHops;
+  }
+}
+
+//
+// The entropy of a probability, in nats
+//
+
+static double
+hopping_bayes_entropyterm(double p) {
+  return(p > 0.0 ? -p * log(p) : 0.0);
+}
+
+//
+// The expected information gain of a probe with the given TTL, for a
+// hop count distribution where the hop count is at most ttl with
+// probability belowMass
+//
+
+static double
+hopping_bayes_informationgain(double belowMass) {
+  
+  double echo = 1.0 - HOPPING_BAYES_LOSS;
+  double exceeded = (1.0 - bayesSilence) * (1.0 - HOPPING_BAYES_LOSS);
+  double pEcho = belowMass * echo;
+  double pExceeded = (1.0 - belowMass) * exceeded;
+  double outcomeEntropy =
+    hopping_bayes_entropyterm(pEcho) +
+    hopping_bayes_entropyterm(pExceeded) +
+    hopping_bayes_entropyterm(1.0 - pEcho - pExceeded);
+  double noiseEntropy =
+    belowMass * (hopping_bayes_entropyterm(echo) +
+		 hopping_bayes_entropyterm(1.0 - echo)) +
+    (1.0 - belowMass) * (hopping_bayes_entropyterm(exceeded) +
+			 hopping_bayes_entropyterm(1.0 - exceeded));
+  
+  return(outcomeEntropy - noiseEntropy);
+}
+
+//
+// Choose the TTL for the next probe: the not yet probed TTL in the
+// current range with the largest expected information gain.
+//
+// The probes already sent, including those still waiting for a
+// response, split the hop counts into intervals; once their
+// responses arrive, the hop count is known to be in one of
+// them. So the gain of a new probe is computed within its interval,
+// and weighted by the interval's probability. This spreads the
+// probes of a parallel window over the posterior instead of sending
+// them all to the same quantile.
+//
+
+static unsigned char
+hopping_bayes_select(struct hopping_destination* destination) {
+
+  double cumulative[257];
+  double bestGain = -1.0;
+  unsigned int best = destination->hopsMinInclusive;
+  unsigned int start = 0;
+  unsigned int h;
+  
+  hopping_assert(destination != 0);
+  
+  cumulative[0] = 0.0;
+  for (h = 0; h < 256; h++) {
+    cumulative[h + 1] = cumulative[h] + destination->posterior[h];
+  }
+  
+  //
+  // Go through the intervals between probed TTLs. The interval
+  // start..end covers hop counts start+1..end, where start and end
+  // are probed TTLs (or 0 and 255).
+  //
+  
+  while (start < 255) {
+    
+    unsigned int end = start + 1;
+    double mass;
+    
+    while (end < 255 && !hopping_ttlinset(destination->ttlsProbed,end)) end++;
+    mass = cumulative[end + 1] - cumulative[start + 1];
+    
+    if (mass > 0.0) {
+      for (h = start + 1; h <= end; h++) {
+	double gain;
+	if (h < destination->hopsMinInclusive || h > destination->hopsMaxInclusive) continue;
+	if (hopping_ttlinset(destination->ttlsProbed,h)) continue;
+	gain = mass * hopping_bayes_informationgain((cumulative[h + 1] - cumulative[start + 1]) / mass);
+	if (gain > bestGain) {
+	  bestGain = gain;
+	  best = h;
+	}
+      }
+    } else if (bestGain < 0.0) {
+      for (h = start + 1; h <= end && bestGain < 0.0; h++) {
+	if (h < destination->hopsMinInclusive || h > destination->hopsMaxInclusive) continue;
+	if (hopping_ttlinset(destination->ttlsProbed,h)) continue;
+	bestGain = 0.0;
+	best = h;
+      }
+    }
+    
+    start = end;
+    
+  }
+  
+  debugf("bayes search picks ttl %u with expected information gain %f nats", best, bestGain);
+  return((unsigned char)best);
+}
+
+//
+// Fingerprinting -------------------------------------------------------------
+//
+// With -fingerprint, the search for a destination opens with a
+// single probe with TTL -maxttl, and waits for its response. Most
+// hosts send their packets with an initial TTL of 64, 128 or 255, so
+// the TTL in the ECHO REPLY usually tells how long the path back
+// from the destination is, assuming the smallest of these initial
+// TTLs that is large enough. The path there is usually as long, so
+// that hop count is then confirmed with two parallel probes, one
+// with that TTL and one with a TTL one smaller. If the guess was
+// right, the search is over. Otherwise, or if the opening probe gets
+// no ECHO REPLY, the responses have narrowed the range of possible
+// hop counts, and the search continues with the selected algorithm.
+//
+
+static const unsigned int hopping_fingerprint_initialttls[] = { 64, 128, 255 };
+
+//
+// End fingerprinting, and let the algorithm continue with the full
+// -parallel probes, less the probes that are still out
+//
+
+static void
+hopping_fingerprint_finish(struct hopping_destination* destination) {
+  hopping_assert(destination != 0);
+  destination->fingerprintState = hopping_fingerprintState_done;
+  hopping_bucket_initialize(destination,
+			    parallel - hopping_min(parallel,
+						   hopping_waitingforresponses(destination)));
+}
+
+//
+// Would a confirmation probe with a given TTL tell anything new?
+//
+
+static int
+hopping_fingerprint_useful(struct hopping_destination* destination,
+			   unsigned int ttl) {
+  hopping_assert(destination != 0);
+  return(ttl >= destination->hopsMinInclusive &&
+	 ttl < destination->hopsMaxInclusive &&
+	 !hopping_ttlinset(destination->ttlsProbed,ttl));
+}
+
+//
+// Choose the TTL for the next probe, if the fingerprinting has one
+// to send. Returns 0 if it does not, and the algorithm should choose.
+//
+
+static int
+hopping_fingerprint_select(struct hopping_destination* destination) {
+  
+  unsigned int guess;
+  
+  hopping_assert(destination != 0);
+  
+  switch (destination->fingerprintState) {
+    
+  case hopping_fingerprintState_start:
+    destination->fingerprintState = hopping_fingerprintState_opening;
+    destination->currentTtl = maxTtl;
+    return(1);
+    
+  case hopping_fingerprintState_confirming:
+    
+    //
+    // Send the confirmation probes, and then nothing else until
+    // their responses are in
+    //
+    
+    guess = destination->fingerprintGuess;
+    if (hopping_fingerprint_useful(destination,guess)) {
+      destination->currentTtl = guess;
+      if (hopping_fingerprint_useful(destination,guess - 1)) return(1);
+    } else if (hopping_fingerprint_useful(destination,guess - 1)) {
+      destination->currentTtl = guess - 1;
+    } else {
+      hopping_fingerprint_finish(destination);
+      return(0);
+    }
+    destination->fingerprintState = hopping_fingerprintState_checking;
+    hopping_bucket_initialize(destination,0);
+    return(1);
+    
+  case hopping_fingerprintState_opening:
+  case hopping_fingerprintState_checking:
+    
+    //
+    // Another probe is needed before the responses came in, so
+    // one of the probes was probably lost. Give up on
+    // fingerprinting.
+    //
+    
+    debugf("no response to a fingerprint probe, falling back to search");
+    hopping_fingerprint_finish(destination);
+    return(0);
+    
+  default:
+    return(0);
+    
+  }
+}
+
+//
+// A response to a probe has been received, and its task released. If
+// it was the response to the opening probe, guess the hop count from
+// the response TTL.
+//
+
+static void
+hopping_fingerprint_observe(struct hopping_destination* destination,
+			    enum hopping_responseType type,
+			    unsigned char responseTtl) {
+  
+  unsigned int initialTtl = 0;
+  unsigned int guess;
+  unsigned int i;
+  
+  hopping_assert(destination != 0);
+  
+  if (destination->fingerprintState == hopping_fingerprintState_checking) {
+    if (hopping_waitingforresponses(destination) == 0) {
+      hopping_fingerprint_finish(destination);
+    } else {
+      hopping_bucket_initialize(destination,0);
+    }
+    return;
+  }
+  
+  if (destination->fingerprintState != hopping_fingerprintState_opening) return;
+  hopping_fingerprint_finish(destination);
+  if (type != hopping_responseType_echoResponse) return;
+  
+  for (i = 0; i < sizeof(hopping_fingerprint_initialttls) / sizeof(hopping_fingerprint_initialttls[0]); i++) {
+    if (hopping_fingerprint_initialttls[i] > responseTtl) {
+      initialTtl = hopping_fingerprint_initialttls[i];
+      break;
+    }
+  }
+  if (initialTtl == 0) return;
+  
+  guess = hopping_min(initialTtl - responseTtl,destination->hopsMaxInclusive);
+  debugf("echo reply TTL %u suggests initial TTL %u and %u hops",
+	 responseTtl, initialTtl, guess);
+  if (!hopping_fingerprint_useful(destination,guess) &&
+      !hopping_fingerprint_useful(destination,guess - 1)) return;
+  
+  //
+  // Confirm with two parallel probes, whatever -parallel is
+  //
+  
+  destination->fingerprintGuess = (unsigned char)guess;
+  destination->fingerprintState = hopping_fingerprintState_confirming;
+  hopping_bucket_initialize(destination,2);
+}
+
+//
+// Optimal search -------------------------------------------------------------
+//
+// With -algorithm optimal, the TTLs to probe are looked up from a
+// policy table that gives, for every range lo..hi of possible hop
+// counts, the set of TTLs to probe in the next round. The table is
+// computed by dynamic programming from the hop count distribution,
+// so that the expected number of rounds is minimal, -parallel being
+// the number of probes in a round. Each probe also adds
+// HOPPING_OPTIMAL_PROBE_COST to the cost, so that without
+// parallelism the expected number of probes is minimal, and with
+// it, no more probes are used than are needed. Only hop counts up
+// to -maxttl are considered.
+//
+// A probe with TTL t splits lo..hi in two: an ECHO REPLY means
+// lo..t, and a TIME EXCEEDED means t+1..hi. A round of m probes
+// splits it in m+1 parts. The expected cost of a range is
+//
+//   E(lo,hi) = min over m and cuts of
+//                1 + m * HOPPING_OPTIMAL_PROBE_COST +
+//                sum over parts a..b of P(a..b) / P(lo..hi) * E(a,b)
+//
+// with E(h,h) = 0. For a fixed lo, the best way to split lo..x into
+// j+1 parts, G(j,x), only needs G(j-1,y) for y < x and E for ranges
+// that start after lo. So the table is computed for lo from the top
+// down, and for each lo for x from the bottom up.
+//
+// Computing the table takes a while for large -parallel values, so
+// it can be kept in a cache file (-optimal-cache). The file records
+// the parameters and a hash of the distribution that it was
+// computed for, and is recomputed if they do not match.
+//
+
+//
+// The TTLs of the policy for range lo..hi
+//
+
+static unsigned char*
+hopping_optimal_entry(unsigned int lo,
+		      unsigned int hi) {
+  hopping_assert(optimalPolicy != 0);
+  hopping_assert(lo <= 255 && hi <= 255);
+  return(&optimalPolicy[(lo * 256 + hi) * optimalPolicyWidth]);
+}
+
+//
+// A hash of the hop count distribution, to tell whether a cached
+// policy was computed for the current one
+//
+
+static uint32_t
+hopping_optimal_distributionhash(void) {
+  
+  const unsigned char* bytes = (const unsigned char*)hopsprobabilitydistribution;
+  uint32_t hash = 2166136261u;
+  unsigned int i;
+  
+  for (i = 0; i < sizeof(hopsprobabilitydistribution); i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  
+  return(hash);
+}
+
+//
+// Compute the policy table
+//
+
+static void
+hopping_optimal_compute(void) {
+  
+  unsigned int n = maxTtl;
+  unsigned int k = optimalPolicyWidth;
+  double* expected;
+  double* split;
+  unsigned char* cut;
+  unsigned int lo;
+  
+  expected = (double*)calloc(256 * 256,sizeof(double));
+  split = (double*)calloc((k + 1) * 256,sizeof(double));
+  cut = (unsigned char*)calloc((k + 1) * 256,sizeof(unsigned char));
+  if (expected == 0 || split == 0 || cut == 0) {
+    fatalf("cannot allocate memory for the optimal policy");
+  }
+  
+#define hopping_optimal_expected(a,b)	expected[(a) * 256 + (b)]
+#define hopping_optimal_split(j,x)	split[(j) * 256 + (x)]
+#define hopping_optimal_cut(j,x)	cut[(j) * 256 + (x)]
+  
+  for (lo = n; lo >= 1; lo--) {
+    
+    unsigned int x;
+    
+    for (x = lo; x <= n; x++) {
+      
+      double mass = hopping_distributionmass(lo,x);
+      double best = 0.0;
+      unsigned int bestParts = 0;
+      unsigned int j;
+      
+      //
+      // Best splits of lo..x in j+1 parts, for j = 1..k
+      //
+      
+      for (j = 1; j <= k && j <= x - lo; j++) {
+	
+	double bestSplit = -1.0;
+	unsigned int y;
+	
+	for (y = lo + j - 1; y < x; y++) {
+	  double cost =
+	    hopping_optimal_split(j - 1,y) +
+	    hopping_distributionmass(y + 1,x) * hopping_optimal_expected(y + 1,x);
+	  if (bestSplit < 0.0 || cost < bestSplit) {
+	    bestSplit = cost;
+	    hopping_optimal_cut(j,x) = y;
+	  }
+	}
+	hopping_optimal_split(j,x) = bestSplit;
+	
+	if (bestParts == 0 ||
+	    1.0 + j * HOPPING_OPTIMAL_PROBE_COST + bestSplit / mass < best) {
+	  best = 1.0 + j * HOPPING_OPTIMAL_PROBE_COST + bestSplit / mass;
+	  bestParts = j;
+	}
+	
+      }
+      
+      hopping_optimal_expected(lo,x) = best;
+      hopping_optimal_split(0,x) = mass * best;
+      
+      //
+      // Record the TTLs of the best split
+      //
+      
+      if (bestParts > 0) {
+	unsigned char* entry = hopping_optimal_entry(lo,x);
+	unsigned int end = x;
+	for (j = bestParts; j >= 1; j--) {
+	  end = hopping_optimal_cut(j,end);
+	  entry[j - 1] = end;
+	}
+      }
+      
+    }
+    
+  }
+  
+  debugf("optimal policy expects %f rounds for 1..%u", hopping_optimal_expected(1,n), n);
+
+#undef hopping_optimal_expected
+#undef hopping_optimal_split
+#undef hopping_optimal_cut
+  
+  free(expected);
+  free(split);
+  free(cut);
+}
+
+//
+// Read the policy table from the cache file. Returns 0 if the file
+// does not exist, does not start with the header of the current
+// parameters, or has no entries.
+//
+
+static int
+hopping_optimal_load(const char* fileName) {
+  
+  char buffer[HOPPING_MAX_OPTIMAL_LINE];
+  char expectedHeader[HOPPING_MAX_OPTIMAL_LINE];
+  unsigned int line = 0;
+  unsigned int entries = 0;
+  int seenHeader = 0;
+  FILE* input;
+  
+  hopping_assert(fileName != 0);
+  
+  if ((input = fopen(fileName,"r")) == 0) return(0);
+  
+  snprintf(expectedHeader,sizeof(expectedHeader),
+	   "parallel %u maxttl %u distribution %08x\n",
+	   optimalPolicyWidth, maxTtl, hopping_optimal_distributionhash());
+  
+  while (fgets(buffer,sizeof(buffer),input) != 0) {
+    
+    char* position = buffer;
+    unsigned int lo;
+    unsigned int hi;
+    unsigned int j;
+    int used;
+    
+    line++;
+    if (buffer[0] == '#') continue;
+    if (!seenHeader) {
+      if (strcmp(buffer,expectedHeader) != 0) {
+	debugf("optimal policy cache %s is for other parameters", fileName);
+	fclose(input);
+	return(0);
+      }
+      seenHeader = 1;
+      continue;
+    }
+    
+    if (sscanf(position,"%u %u%n",&lo,&hi,&used) != 2 ||
+	lo < 1 || hi > maxTtl || lo >= hi) {
+      fatalf("invalid line %u in optimal policy cache %s", line, fileName);
+    }
+    position += used;
+    for (j = 0; j < optimalPolicyWidth; j++) {
+      unsigned int ttl;
+      if (sscanf(position,"%u%n",&ttl,&used) != 1) break;
+      if (ttl < lo || ttl >= hi) {
+	fatalf("invalid line %u in optimal policy cache %s", line, fileName);
+      }
+      hopping_optimal_entry(lo,hi)[j] = ttl;
+      position += used;
+    }
+    if (j == 0) {
+      fatalf("invalid line %u in optimal policy cache %s", line, fileName);
+    }
+    entries++;
+    
+  }
+  
+  fclose(input);
+  if (entries == 0) {
+    debugf("optimal policy cache %s has no entries", fileName);
+    return(0);
+  }
+  debugf("read optimal policy from %s", fileName);
+  return(1);
+}
+
+//
+// Write the policy table to the cache file, via a temporary file
+//
+
+static void
+hopping_optimal_save(const char* fileName) {
+  
+  char* tempName;
+  FILE* output;
+  unsigned int lo;
+  unsigned int hi;
+  unsigned int j;
+  
+  hopping_assert(fileName != 0);
+  
+  tempName = (char*)malloc(strlen(fileName) + 5);
+  if (tempName == 0) {
+    fatalf("cannot allocate memory for a file name");
+  }
+  sprintf(tempName,"%s.tmp",fileName);
+  
+  if ((output = fopen(tempName,"w")) == 0) {
+    fatalf("cannot write optimal policy cache %s", tempName);
+  }
+  
+  fprintf(output,"# hopping optimal search policy\n");
+  fprintf(output,"# hop count range, TTLs to probe\n");
+  fprintf(output,"parallel %u maxttl %u distribution %08x\n",
+	  optimalPolicyWidth, maxTtl, hopping_optimal_distributionhash());
+  for (lo = 1; lo <= maxTtl; lo++) {
+    for (hi = lo + 1; hi <= maxTtl; hi++) {
+      unsigned char* entry = hopping_optimal_entry(lo,hi);
+      fprintf(output,"%u %u", lo, hi);
+      for (j = 0; j < optimalPolicyWidth && entry[j] != 0; j++) {
+	fprintf(output," %u", entry[j]);
+      }
+      fprintf(output,"\n");
+    }
+  }
+  
+  if (fclose(output) != 0 || rename(tempName,fileName) != 0) {
+    fatalf("cannot write optimal policy cache %s", fileName);
+  }
+  
+  debugf("wrote optimal policy cache %s", fileName);
+  free(tempName);
+}
+
+//
+// Set up the policy table, from the cache file if possible
+//
+
+static void
+hopping_optimal_initialize(void) {
+  
+  optimalPolicyWidth = hopping_min(parallel,254);
+  optimalPolicy = (unsigned char*)calloc(256 * 256 * optimalPolicyWidth,sizeof(unsigned char));
+  if (optimalPolicy == 0) {
+    fatalf("cannot allocate memory for the optimal policy");
+  }
+  
+  if (optimalCacheFile != 0 && hopping_optimal_load(optimalCacheFile)) return;
+  
+  hopping_optimal_compute();
+  if (optimalCacheFile != 0) {
+    hopping_optimal_save(optimalCacheFile);
+  }
+}
+
+//
+// Choose the TTL for the next probe: the first TTL in the policy for
+// the current range that has not been probed yet. If all of them
+// have been (the responses are still on their way), or the range is
+// beyond -maxttl, fall back to binary search.
+//
+
+static unsigned char
+hopping_optimal_select(struct hopping_destination* destination) {
+  
+  unsigned int lo;
+  unsigned int hi;
+  unsigned int j;
+  
+  hopping_assert(destination != 0);
+  
+  lo = destination->hopsMinInclusive;
+  hi = hopping_min(destination->hopsMaxInclusive,maxTtl);
+  
+  if (lo < hi) {
+    unsigned char* entry = hopping_optimal_entry(lo,hi);
+    for (j = 0; j < optimalPolicyWidth && entry[j] != 0; j++) {
+      if (!hopping_ttlinset(destination->ttlsProbed,entry[j])) {
+	debugf("optimal policy for %u..%u picks ttl %u", lo, hi, entry[j]);
+	return(entry[j]);
+      }
+    }
+  }
+  
+  debugf("optimal policy for %u..%u has no unprobed ttls left", lo, hi);
+  return(hopping_bestbinarysearchvalue(destination,
+				       destination->hopsMinInclusive,
+				       destination->hopsMaxInclusive,
+				       1));
+}
+
+//
+// Latency-weighted search ----------------------------------------------------
+//
+// With -algorithm latency, the search minimizes the expected time to
+// the result rather than the number of probes. Probes for TTLs at or
+// above the hop count get an ECHO REPLY from the destination, those
+// below it a TIME EXCEEDED from a router, and the two can differ a
+// lot in how fast and how reliably they come: routers often rate
+// limit or drop their errors, or generate them slowly. For each
+// outcome, the probability of a response and the mean response
+// delay are learned from the probes of the destination so far. A
+// probe that gets no response costs a retransmission timeout, so
+// the expected time to learn the outcome of a probe with TTL t is
+//
+//   delay + (1 / probability - 1) * timeout
+//
+// for the outcome that it will have. Each probe is sent with the TTL
+// that gives the most information (in bits, over the hop count
+// distribution in the current range) per expected time. Until the
+// first responses come in, both outcomes look the same, and this is
+// the same as binary search.
+//
+
+//
+// Learn the model from the probes of the destination. A probe that
+// timed out counts as lost for the outcome it would have had, if the
+// range learned so far tells which that is.
+//
+
+static void
+hopping_latency_model(struct hopping_destination* destination,
+		      struct hopping_latencymodel* model) {
+  
+  struct hopping_probe* probe;
+  double echoResponses = 0.0;
+  double echoLosses = 0.0;
+  double echoDelay = 0.0;
+  double exceededResponses = 0.0;
+  double exceededLosses = 0.0;
+  double exceededDelay = 0.0;
+  double defaultDelay;
+  
+  hopping_assert(destination != 0);
+  hopping_assert(model != 0);
+  
+  for (probe = destination->probeList;
+       probe != 0;
+       probe = hopping_probestats(probe)->destinationNext) {
+    
+    if (probe->responded) {
+      if (probe->responseType == hopping_responseType_echoResponse) {
+	echoResponses += 1.0;
+	echoDelay += hopping_probestats(probe)->delayUSecs;
+      } else if (probe->responseType == hopping_responseType_timeExceeded) {
+	exceededResponses += 1.0;
+	exceededDelay += hopping_probestats(probe)->delayUSecs;
+      }
+    } else if (probe->responseType == hopping_responseType_noResponse &&
+	       !probe->timerArmed) {
+      if (probe->hops >= destination->hopsMaxInclusive) echoLosses += 1.0;
+      else if (probe->hops < destination->hopsMinInclusive) exceededLosses += 1.0;
+    }
+    
+  }
+  
+  model->echoProbability =
+    (echoResponses + HOPPING_LATENCY_PRIOR_PROBABILITY * HOPPING_LATENCY_PRIOR_WEIGHT) /
+    (echoResponses + echoLosses + HOPPING_LATENCY_PRIOR_WEIGHT);
+  model->timeExceededProbability =
+    (exceededResponses + HOPPING_LATENCY_PRIOR_PROBABILITY * HOPPING_LATENCY_PRIOR_WEIGHT) /
+    (exceededResponses + exceededLosses + HOPPING_LATENCY_PRIOR_WEIGHT);
+  
+  defaultDelay = (destination->rtt.samples > 0 ?
+		  (double)destination->rtt.srttUSecs :
+		  HOPPING_LATENCY_DEFAULT_DELAY_US);
+  model->echoDelayUSecs = (echoResponses > 0.0 ? echoDelay / echoResponses : defaultDelay);
+  model->timeExceededDelayUSecs = (exceededResponses > 0.0 ? exceededDelay / exceededResponses : defaultDelay);
+}
+
+//
+// Find the TTL in lo..hi-1, not in the excluded set (if any), whose
+// probe gives the most information per expected time under a model,
+// and the expected time to learn its outcome. Returns 0 if there are
+// no such TTLs.
+//
+
+static unsigned int
+hopping_latency_bestttl(struct hopping_destination* destination,
+			const struct hopping_latencymodel* model,
+			unsigned int lo,
+			unsigned int hi,
+			const uint64_t* excluded,
+			double* expectedTime) {
+  
+  unsigned int ttl;
+  unsigned int bestTtl = 0;
+  double bestRate = 0.0;
+  double mass;
+  
+  hopping_assert(destination != 0);
+  hopping_assert(model != 0);
+  hopping_assert(expectedTime != 0);
+  
+  mass = hopping_distributionmass(lo,hi);
+  
+  for (ttl = lo; ttl < hi; ttl++) {
+    
+    double below;
+    double timeout;
+    double echoTime;
+    double exceededTime;
+    double information;
+    double time;
+    double rate;
+    
+    if (excluded != 0 && hopping_ttlinset(excluded,ttl)) continue;
+    
+    below = hopping_distributionmass(lo,ttl) / mass;
+    timeout = hopping_rtt_initialtimeout(destination,ttl);
+    echoTime = model->echoDelayUSecs + (1.0 / model->echoProbability - 1.0) * timeout;
+    exceededTime = model->timeExceededDelayUSecs + (1.0 / model->timeExceededProbability - 1.0) * timeout;
+    information = (hopping_bayes_entropyterm(below) +
+		   hopping_bayes_entropyterm(1.0 - below)) / log(2.0);
+    time = below * echoTime + (1.0 - below) * exceededTime;
+    rate = information / time;
+    if (bestTtl == 0 || rate > bestRate) {
+      bestTtl = ttl;
+      bestRate = rate;
+      *expectedTime = time;
+    }
+    
+  }
+  
+  return(bestTtl);
+}
+
+//
+// Choose the TTL for the next probe: the not yet probed TTL in the
+// current range with the most information per expected time
+//
+
+static unsigned char
+hopping_latency_select(struct hopping_destination* destination) {
+  
+  struct hopping_latencymodel model;
+  unsigned int lo;
+  unsigned int hi;
+  unsigned int bestTtl;
+  double time = 0.0;
+  
+  hopping_assert(destination != 0);
+  
+  lo = destination->hopsMinInclusive;
+  hi = destination->hopsMaxInclusive;
+  hopping_latency_model(destination,&model);
+  bestTtl = hopping_latency_bestttl(destination,&model,lo,hi,destination->ttlsProbed,&time);
+  
+  if (bestTtl == 0) {
+    return(hopping_bestbinarysearchvalue(destination,lo,hi,1));
+  }
+  
+  debugf("latency search picks ttl %u in %u..%u, expected time %.3f ms",
+	 bestTtl, lo, hi, time / 1000.0);
+  return((unsigned char)bestTtl);
+}
+
+//
+// The expected time for the latency search to narrow lo..hi down to
+// one hop count, under a model: the expected time of the probe it
+// sends first, plus that of the search in whichever part of the
+// range the outcome leaves. The times are memoized in a table of
+// 256 x 256 ranges, negative until computed.
+//
+
+static double
+hopping_latency_expectedtimeaux(struct hopping_destination* destination,
+				const struct hopping_latencymodel* model,
+				unsigned int lo,
+				unsigned int hi,
+				double* table) {
+  
+  double* entry = &table[lo * 256 + hi];
+  unsigned int ttl;
+  double time = 0.0;
+  double below;
+  
+  if (lo >= hi) return(0.0);
+  if (*entry >= 0.0) return(*entry);
+  
+  ttl = hopping_latency_bestttl(destination,model,lo,hi,0,&time);
+  hopping_assert(ttl != 0);
+  below = hopping_distributionmass(lo,ttl) / hopping_distributionmass(lo,hi);
+  *entry = (time +
+	    below * hopping_latency_expectedtimeaux(destination,model,lo,ttl,table) +
+	    (1.0 - below) * hopping_latency_expectedtimeaux(destination,model,ttl + 1,hi,table));
+  return(*entry);
+}
+
+//
+// The expected time for the latency search to find the hop count of
+// a destination from scratch, as predicted by the model learned from
+// its probes
+//
+
+static double
+hopping_latency_expectedtime(struct hopping_destination* destination) {
+  
+  struct hopping_latencymodel model;
+  double* table;
+  double time;
+  unsigned int i;
+  
+  hopping_assert(destination != 0);
+  
+  table = (double*)malloc(256 * 256 * sizeof(double));
+  if (table == 0) {
+    fatalf("cannot allocate memory for the expected time");
+  }
+  for (i = 0; i < 256 * 256; i++) table[i] = -1.0;
+  
+  hopping_latency_model(destination,&model);
+  time = hopping_latency_expectedtimeaux(destination,&model,1,255,table);
+  free(table);
+  return(time);
+}
+
+//
+// Re-initialize currentTtl to the currently learned range
+//
+
+static unsigned char
+hopping_readjusttolearnedrange(struct hopping_destination* destination,
+			       int fromthetop) {
+
+  if (readjust) {
+    unsigned char newValue =
+      fromthetop ? destination->hopsMaxInclusive : destination->hopsMinInclusive;
+    debugf("readjusted currentTtl to %u (in range %u..%u)",
+	   newValue, destination->hopsMinInclusive, destination->hopsMaxInclusive);
+    return(newValue);
+  } else {
+    return(destination->currentTtl);
+  }
+
+}
+
+//
+// Create send one new probe
+//
+
+static struct hopping_probe*
+hopping_sendprobe(int sd,
+		  struct hopping_destination* destination,
+		  struct sockaddr_in* sourceAddress,
+		  int inbucket) {
+  
+  struct hopping_probe* probe;
+  int speculate = 0;
+  
+  //
+  // Depending on algorithm, adjust behaviour
+  //
+  
+  if (fingerprint && hopping_fingerprint_select(destination)) {
+    
+    debugf("selected fingerprint ttl %u", destination->currentTtl);
+    
+  } else switch (algorithm) {
+    
+  case hopping_algorithms_random:
+    
+    debugf("before random selection, min = %u and max = %u",
+	   destination->hopsMinInclusive, destination->hopsMaxInclusive);
+    
+    do {
+      
+      //
+      // Random pick
+      //
+      
+      destination->currentTtl =
+	(unsigned char)(((unsigned int)destination->hopsMinInclusive +
+			 (rand() % (((unsigned int)destination->hopsMaxInclusive) -
+				    ((unsigned int)destination->hopsMinInclusive) + 1))));
+      
+      //
+      // If we've already sent probes on all TTLs in the current possible range of
+      // TTLs, then just pick this random number and go with it!
+      //
+      
+      if (hopping_countprobes_notsentinrange(destination,
+					     destination->hopsMinInclusive,
+					     destination->hopsMaxInclusive)) break;
+      
+      //
+      // If we've already sent a probe with this TTL earlier, pick another
+      //
+      
+      if (hopping_thereisprobe_ttl(destination,destination->currentTtl)) continue;
+      
+    } while (1);
+    
+    debugf("selected a random ttl %u in range %u..%u",
+	   destination->currentTtl,
+	   destination->hopsMinInclusive,
+	   destination->hopsMaxInclusive);
+    break;
+    
+  case hopping_algorithms_sequential:
+    
+    //
+    // Increase by one (unless this is the first probe
+    //
+    
+    if (destination->probesSent > 0 && destination->currentTtl < 255) destination->currentTtl++;
+    
+    //
+    // If value falls outside currently learned range, readjust
+    //
+    
+    if (destination->currentTtl < destination->hopsMinInclusive ||
+	destination->currentTtl > destination->hopsMaxInclusive) {
+      
+      destination->currentTtl = hopping_readjusttolearnedrange(destination,0);
+      
+    }
+    
+    //
+    // Done
+    //
+    
+    debugf("selected one larger ttl %u", destination->currentTtl);
+    break;
+    
+  case hopping_algorithms_reversesequential:
+    
+    //
+    // Decrease by one (unless this is the first probe
+    //
+    
+    if (destination->probesSent > 0 && destination->currentTtl > 0) destination->currentTtl--;
+    
+    //
+    // If value falls outside currently learned range, readjust
+    //
+    
+    if (destination->currentTtl < destination->hopsMinInclusive ||
+	destination->currentTtl > destination->hopsMaxInclusive) {
+      
+      destination->currentTtl = hopping_readjusttolearnedrange(destination,1);
+      
+    }
+    
+    //
+    // Done
+    //
+    
+    debugf("selected one smaller ttl %u", destination->currentTtl);
+    break;
+    
+  case hopping_algorithms_binarysearch:
+    
+    speculate = (inbucket && speculationBudget > 0);
+    if (hopping_round_inuse()) {
+      
+      speculate = 0;
+      destination->currentTtl = hopping_round_select(destination,inbucket);
+      
+    } else if (likelyCandidates && destination->probesSent == 0) {
+      
+      destination->currentTtl =
+	hopping_bestinitialguess(destination->hopsMinInclusive,
+				 destination->hopsMaxInclusive);
+      
+    } else if (likelyCandidates &&
+	       hopping_responses(destination) == 0 &&
+	       destination->probesSent < HOPPING_N_TYPICAL_HOP_COUNT_TRIES) {
+      
+      destination->currentTtl =
+	hopping_bestinitialotherguess(destination,
+				      destination->hopsMinInclusive,
+				      destination->hopsMaxInclusive,
+				      inbucket ? destination->bucket : 1);
+      
+    } else {
+      
+      destination->currentTtl =
+	hopping_bestbinarysearchvalue(destination,
+				      destination->hopsMinInclusive,
+				      destination->hopsMaxInclusive,
+				      inbucket ? destination->bucket : 1);
+      
+    }
+    break;
+    
+  case hopping_algorithms_bayes:
+    
+    destination->currentTtl = hopping_bayes_select(destination);
+    break;
+    
+  case hopping_algorithms_optimal:
+    
+    destination->currentTtl = hopping_optimal_select(destination);
+    break;
+    
+  case hopping_algorithms_latency:
+    
+    destination->currentTtl = hopping_latency_select(destination);
+    break;
+    
+  default:
+    fatalf("invalid internal algorithm identifier");
+      
+  }
+  
+  //
+  // Send the probe, and possibly speculative probes for what comes
+  // after it
+  //
+  
+  probe = hopping_sendprobewithttl(sd,destination,sourceAddress,destination->currentTtl);
+  hopping_redundancy_schedule(destination,probe);
+  if (speculate) {
+    hopping_speculate(sd,destination,sourceAddress,probe);
+  }
+
+  //
+  // Done. Return the probe.
+  //
+  
+  return(probe);
+}
+
+//
+// Create a packet with a given TTL and send it
 //
 
-static void
-hopping_reportprogress_received_other() {
+static struct hopping_probe*
+hopping_sendprobewithttl(int sd,
+			 struct hopping_destination* destination,
+			 struct sockaddr_in* sourceAddress,
+			 unsigned char ttl) {
   
-  if (progress) {
-    printf(" <--- OTHER");
-    lastprogressreportwassentpacket = 0;
-    seenprogressreport = 1;
-    fflush(stdout);
+  struct hopping_probe* probe;
+  unsigned int expectedLen;
+  hopping_idtype id;
+  
+  id = hopping_getnewid(ttl);
+  expectedLen = HOPPING_IP4_HDRLEN + HOPPING_ICMP4_HDRLEN + icmpDataLength;
+  probe = hopping_newprobe(destination,id,ttl,expectedLen,0);
+  if (probe == 0) {
+    fatalf("cannot allocate a new probe entry");
   }
   
+  hopping_sendprobeaux(sd,
+		       destination,
+		       sourceAddress,
+		       expectedLen,
+		       probe);
+  
+  //
+  // Report progress on screen
+  //
+  
+  hopping_reportprogress_sent(id,probe->hops,0);
+  return(probe);
 }
 
 //
-// Reporting progress: timer on our side fired, considering
-// retransmission for the probe
+// Speculative probing -------------------------------------------------------
+//
+// With -speculate n, a binary search probe with TTL t is followed
+// right away by the probes that the search would send next after
+// each of its two possible outcomes: one splitting min..t, for an
+// ECHO REPLY, and one splitting t+1..max, for a TIME EXCEEDED. When
+// the response to t comes, the probe for the other outcome is
+// outside the new range and is cancelled like any useless
+// probe. The one for the right outcome has already been on its way
+// for a while, and takes over as the search's probe, with its own
+// speculative probes. This trades extra probes for time, which
+// matters on long round-trip paths. Speculative probes do not take
+// tasks from the bucket, are not retransmitted, and at most n of
+// them are sent per destination.
 //
-
-static void
-hopping_reportprogress_retransmissionconsidered(hopping_idtype id,
-						unsigned char ttl) {
-  
-  hopping_reportprogress_received(hopping_responseType_retransmissionConsidered,
-				  id,
-				  ttl);
-}
 
 //
-// Reporting progress: received nothing
+// Send a speculative probe with a given TTL, if it would be useful
+// and the budget allows
 //
 
 static void
-hopping_reportprogress_noresponse(hopping_idtype id,
-				  unsigned char ttl) {
+hopping_speculate_send(int sd,
+		       struct hopping_destination* destination,
+		       struct sockaddr_in* sourceAddress,
+		       unsigned char ttl) {
   
-  hopping_reportprogress_received(hopping_responseType_noResponse,
-				  id,
-				  ttl);
+  struct hopping_probe* probe;
+  
+  hopping_assert(destination != 0);
+  
+  if (destination->speculativeProbes >= speculationBudget) return;
+  if (destination->probesSent >= maxProbes) return;
+  if (ttl < destination->hopsMinInclusive ||
+      ttl >= destination->hopsMaxInclusive ||
+      hopping_ttlinset(destination->ttlsProbed,ttl)) return;
+  
+  debugf("sending speculative probe with ttl %u", ttl);
+  probe = hopping_sendprobewithttl(sd,destination,sourceAddress,ttl);
+  probe->speculative = 1;
+  destination->speculativeProbes++;
 }
 
 //
-// Reporting progress: done
+// Send the speculative probes for both outcomes of a given probe. An
+// outcome whose range has no TTLs left to probe gets none.
 //
 
 static void
-hopping_reportprogress_end() {
+hopping_speculate(int sd,
+		  struct hopping_destination* destination,
+		  struct sockaddr_in* sourceAddress,
+		  struct hopping_probe* parent) {
   
-  if (progress) {
-    if (seenprogressreport) {
-      printf("\n");
-    }
-  }
+  unsigned char t;
   
+  hopping_assert(destination != 0);
+  hopping_assert(parent != 0);
+  
+  t = parent->hops;
+  if (destination->hopsMinInclusive < t &&
+      t <= destination->hopsMaxInclusive &&
+      hopping_countprobes_notsentinrange(destination,destination->hopsMinInclusive,t) > 0) {
+    hopping_speculate_send(sd,destination,sourceAddress,
+			   hopping_bestbinarysearchvalue(destination,
+							 destination->hopsMinInclusive,
+							 t,
+							 1));
+  }
+  if (t + 1 < destination->hopsMaxInclusive &&
+      t >= destination->hopsMinInclusive &&
+      hopping_countprobes_notsentinrange(destination,t + 1,destination->hopsMaxInclusive) > 0) {
+    hopping_speculate_send(sd,destination,sourceAddress,
+			   hopping_bestbinarysearchvalue(destination,
+							 t + 1,
+							 destination->hopsMaxInclusive,
+							 1));
+  }
 }
 
 //
-// Search for what probes in a given TTL range
-// have not been sent yet
+// If a speculative probe that is still waiting for its response can
+// narrow the range, make it the search's probe instead of sending a
+// new one. Returns 1 if one was found.
 //
 
-static unsigned int
-hopping_probesnotyetsentinrange(unsigned char minTtlValue,
-				unsigned char maxTtlValue) {
-
-  int ttlsUsed[256];
-  unsigned int count = 0;
-  unsigned int id;
-  unsigned int ttl;
-
-  hopping_assert(minTtlValue <= maxTtlValue);
-  memset(ttlsUsed,0,sizeof(ttlsUsed));
+static int
+hopping_speculate_promote(int sd,
+			  struct hopping_destination* destination,
+			  struct sockaddr_in* sourceAddress) {
   
-  for (id = 0; id < HOPPING_MAX_PROBES; id++) {
-    struct hopping_probe* probe = &probes[id];
-    if (probe->used) {
-      ttlsUsed[probe->hops] = 1;
-    }
-  }
+  struct hopping_probe* probe;
+  
+  hopping_assert(destination != 0);
   
-  for (ttl = (unsigned int)minTtlValue;
-       ttl <= (unsigned int)maxTtlValue;
-       ttl++) {
-    if (!ttlsUsed[ttl]) count++;
+  if (destination->speculativeProbes == 0) return(0);
+  
+  for (probe = destination->probeList;
+       probe != 0;
+       probe = hopping_probestats(probe)->destinationNext) {
+    
+    if (!probe->speculative ||
+	probe->responded ||
+	probe->responseType != hopping_responseType_stillWaiting) continue;
+    if (probe->hops < destination->hopsMinInclusive ||
+	probe->hops >= destination->hopsMaxInclusive) continue;
+    
+    debugf("speculative probe id %u ttl %u takes over", probe->id, probe->hops);
+    probe->speculative = 0;
+    hopping_speculate(sd,destination,sourceAddress,probe);
+    return(1);
+    
   }
-
-  return(count);
+  
+  return(0);
 }
 
 //
-// Can and should we continue the probing?
+// Redundant probing ---------------------------------------------------------
+//
+// With -redundancy r, every transmission of a probe is followed by
+// r-1 copies of it, with the same TTL but ids of their own, sent
+// -redundancy-stagger microseconds apart so that a short burst of
+// loss or rate limiting does not take all of them. The copies of one
+// transmission are linked in a ring through redundantNext. The first
+// response to any of them is the response to all: the others are
+// cancelled, copies not yet sent are not sent, and later responses
+// to the others are counted as duplicate responses of the one that
+// was answered. Only the original is retransmitted and holds a task
+// from the bucket; a copy that gets no response just times out.
+// Copies count towards -maxprobes.
 //
-
-static int
-hopping_shouldcontinuesending() {
-  if (interrupt) return(0);
-  if (probesSent >= maxProbes) return(0);
-  if (hopsMinInclusive == hopsMaxInclusive) return(0);
-  if (!hopping_probesnotyetsentinrange(hopsMinInclusive,hopsMaxInclusive)) return(0);
-  return(1);
-}
 
 //
-// Can and should we continue the probing or waiting for responses to
-// the probes already sent?
+// Stop sending further copies of a probe
 //
 
-static int
-hopping_shouldcontinuesendingorwaiting() {
-  struct timeval now;
+static void
+hopping_redundancy_stop(struct hopping_probe* probe) {
   
-  if (interrupt) return(0);
-  if (hopsMinInclusive == hopsMaxInclusive) return(0);
-  if (hopping_waitingforresponses() > 0) return(1);
+  struct hopping_probestats* stats;
   
-  hopping_getcurrenttime(&now);
-  if (startTime.tv_sec + maxWait < now.tv_sec) return(0);
+  hopping_assert(probe != 0);
+  stats = hopping_probestats(probe);
   
-  return(hopping_shouldcontinuesending());
+  if (stats->redundantCopiesLeft == 0) return;
+  stats->redundantCopiesLeft = 0;
+  hopping_assert(probe->destination->redundancyPending > 0);
+  probe->destination->redundancyPending--;
 }
 
 //
-// Retransmit a given probe (by creating a new probe)
+// Arrange for the copies of a newly sent probe to be sent
 //
 
 static void
-hopping_retransmitactiveprobe(int sd,
-			      struct sockaddr_in* destinationAddress,
-			      struct sockaddr_in* sourceAddress,
-			      struct hopping_probe* probe) {
+hopping_redundancy_schedule(struct hopping_destination* destination,
+			    struct hopping_probe* probe) {
+  
+  struct timeval due;
+  
+  hopping_assert(destination != 0);
+  hopping_assert(probe != 0);
+  
+  if (redundancy <= 1) return;
+  
+  hopping_probestats(probe)->redundantCopiesLeft = redundancy - 1;
+  hopping_timeadd(&hopping_probestats(probe)->sentTime,redundancyStagger,&due);
+  if (destination->redundancyPending == 0 ||
+      hopping_timeisless(&due,&destination->redundancyTime)) {
+    destination->redundancyTime = due;
+  }
+  destination->redundancyPending++;
+}
 
-  unsigned int expectedLen = HOPPING_IP4_HDRLEN + HOPPING_ICMP4_HDRLEN + icmpDataLength;
-  hopping_idtype id = hopping_getnewid(probe->hops);
-  struct hopping_probe* newProbe;
+//
+// Send the copies of probes that are due, and find out when the next
+// ones are
+//
 
-  hopping_assert(destinationAddress != 0);
-  hopping_assert(sourceAddress != 0);
-  hopping_assert(probe != 0);
+static void
+hopping_redundancy_send(int sd,
+			struct hopping_destination* destination,
+			struct sockaddr_in* sourceAddress,
+			struct timeval* now) {
   
-  debugf("retransmitting probe id %u ttl %u", probe->id, probe->hops);
+  struct hopping_probe* probe;
+  int found = 0;
   
-  newProbe = hopping_newprobe(id,probe->hops,expectedLen,probe);
-  if (probe == 0) {
-    fatalf("cannot allocate a new probe entry");
+  hopping_assert(destination != 0);
+  hopping_assert(now != 0);
+  
+  if (destination->redundancyPending == 0) return;
+  if (hopping_timeisless(now,&destination->redundancyTime)) return;
+  
+  for (probe = destination->probeList;
+       probe != 0 && destination->redundancyPending > 0;
+       probe = hopping_probestats(probe)->destinationNext) {
+    
+    struct hopping_probestats* stats = hopping_probestats(probe);
+    struct hopping_probestats* copyStats;
+    struct hopping_probe* copy;
+    unsigned int expectedLen;
+    struct timeval due;
+    hopping_idtype id;
+    
+    if (stats->redundantCopiesLeft == 0) continue;
+    
+    while (stats->redundantCopiesLeft > 0) {
+      
+      if (probe->responded ||
+	  probe->responseType != hopping_responseType_stillWaiting ||
+	  destination->probesSent >= maxProbes) {
+	hopping_redundancy_stop(probe);
+	break;
+      }
+      
+      hopping_timeadd(&stats->sentTime,
+		      (unsigned long long)redundancyStagger * (redundancy - stats->redundantCopiesLeft),
+		      &due);
+      if (hopping_timeisless(now,&due)) {
+	if (!found || hopping_timeisless(&due,&destination->redundancyTime)) {
+	  destination->redundancyTime = due;
+	}
+	found = 1;
+	break;
+      }
+      
+      //
+      // Send a copy, with the same timeout as the original
+      //
+      
+      id = hopping_getnewid(probe->hops);
+      expectedLen = HOPPING_IP4_HDRLEN + HOPPING_ICMP4_HDRLEN + icmpDataLength;
+      copy = hopping_newprobe(destination,id,probe->hops,expectedLen,0);
+      if (copy == 0) {
+	fatalf("cannot allocate a new probe entry");
+      }
+      copyStats = hopping_probestats(copy);
+      copy->redundant = 1;
+      copy->tries = probe->tries;
+      hopping_timer_cancel(copy);
+      hopping_setprobetimeout(copy,stats->timeoutUSecs);
+      hopping_timer_arm(copy);
+      copyStats->redundantNext = (stats->redundantNext != 0 ? stats->redundantNext : probe);
+      stats->redundantNext = copy;
+      destination->redundantProbes++;
+      debugf("sending redundant copy id %u of probe id %u ttl %u", id, probe->id, probe->hops);
+      hopping_sendprobeaux(sd,destination,sourceAddress,expectedLen,copy);
+      hopping_reportprogress_sent(id,copy->hops,0);
+      
+      stats->redundantCopiesLeft--;
+      if (stats->redundantCopiesLeft == 0) destination->redundancyPending--;
+      
+    }
+    
   }
+}
 
-  //
-  // Send it
-  //
+//
+// Find the copy of a probe that has got a response, if any
+//
+
+static struct hopping_probe*
+hopping_redundancy_answered(struct hopping_probe* probe) {
   
-  hopping_sendprobeaux(sd,
-		       destinationAddress,
-		       sourceAddress,
-		       expectedLen,
-		       newProbe);
+  struct hopping_probe* other;
   
-  //
-  // Report progress on screen
-  //
+  hopping_assert(probe != 0);
   
-  hopping_reportprogress_sent(id,newProbe->hops,1);
+  for (other = hopping_probestats(probe)->redundantNext;
+       other != 0 && other != probe;
+       other = hopping_probestats(other)->redundantNext) {
+    if (other->responded) return(other);
+  }
+  return(0);
 }
 
 //
-// Mark a probe and its predecessors as timed out
+// A probe has got a response. Its copies need not be waited for,
+// retransmitted, or sent at all anymore.
 //
 
 static void
-hopping_markprobe_astimedout(struct hopping_probe* probe) {
+hopping_redundancy_satisfy(struct hopping_probe* probe) {
+  
+  struct hopping_destination* destination;
+  struct hopping_probe* other;
+  
   hopping_assert(probe != 0);
-  debugf("hopping_markprobe_astimedout probe id %u ttl %u responsetype %u noresponse %u",
-	 probe->id, probe->hops, probe->responseType, hopping_responseType_noResponse);
-  hopping_assert(probe->responseType == hopping_responseType_stillWaiting);
-  probe->responseType = hopping_responseType_noResponse;
-  if (probe->previousTransmission != 0 &&
-      probe->previousTransmission->responseType != hopping_responseType_noResponse) {
-    debugf("recursing from probe %u to %u", probe->id, probe->previousTransmission->id);
-    hopping_markprobe_astimedout(probe->previousTransmission);
+  destination = probe->destination;
+  
+  if (!probe->redundant) hopping_redundancy_stop(probe);
+  
+  for (other = hopping_probestats(probe)->redundantNext;
+       other != 0 && other != probe;
+       other = hopping_probestats(other)->redundantNext) {
+    
+    if (!other->redundant) hopping_redundancy_stop(other);
+    if (other->responded ||
+	other->responseType != hopping_responseType_stillWaiting) continue;
+    
+    debugf("probe id %u is answered by its copy id %u", other->id, probe->id);
+    hopping_timer_cancel(other);
+    hopping_setprobestate(other,0,hopping_responseType_cancelled);
+    hopping_reportprogress_received(destination,
+				    hopping_responseType_cancelled,
+				    other->id,
+				    other->hops);
+    if (!other->speculative && !other->redundant) hopping_bucket_releasetask(destination);
+    
   }
 }
 
 //
-// Check to see if we need to retransmit any of the currently
-// active (not responded to) probes
+// Queue as many new probes as we are allowed to send right now
 //
 
 static void
-hopping_retransmitactiveprobes(int sd,
-			       struct sockaddr_in* destinationAddress,
-			       struct sockaddr_in* sourceAddress) {
+hopping_sendprobes(int sd,
+		   struct hopping_destination* destination,
+		   struct sockaddr_in* sourceAddress) {
 
   struct timeval now;
-  hopping_idtype otherid;
-  
-  hopping_assert(destinationAddress != 0);
-  hopping_assert(sourceAddress != 0);
   
   //
-  // Get current time
+  // If there's room in the "bucket", and the probe pacing
+  // allows it, send more new probes
   //
   
   hopping_getcurrenttime(&now);
   
+  while (hopping_bucket_cantakeontask(destination) &&
+	 hopping_round_cansend(destination) &&
+	 hopping_shouldcontinuesending(destination) &&
+	 !hopping_timeisless(&now,&destination->nextProbeTime)) {
+    
+    if (hopping_speculate_promote(sd,destination,sourceAddress)) {
+      hopping_bucket_taketask(destination);
+      continue;
+    }
+    hopping_sendprobe(sd,destination,sourceAddress,1);
+    hopping_bucket_taketask(destination);
+    hopping_timeadd(&now,probePacing,&destination->nextProbeTime);
+    
+  }
+  
   //
-  // If there are probes whose response has not arrived and their
-  // timeouts expire, send retransmissions
+  // And the redundant copies of probes that are due, including
+  // those of the probes just sent if there is no stagger
   //
   
-  for (otherid = 0; otherid < HOPPING_MAX_PROBES; otherid++) {
+  hopping_getcurrenttime(&now);
+  hopping_redundancy_send(sd,destination,sourceAddress,&now);
+  
+}
+
+//
+// Read the next destination name from the targets file. Empty lines
+// and lines starting with # are skipped. Returns 1 if a name was
+// found, 0 at the end of the file.
+//
+
+static int
+hopping_readtarget(char* buffer,
+		   unsigned int bufferSize) {
+
+  hopping_assert(buffer != 0);
+  
+  if (targetsInput == 0) return(0);
+  
+  while (fgets(buffer,bufferSize,targetsInput) != 0) {
     
-    struct hopping_probe* probe = &probes[otherid];
+    char* start = buffer;
+    char* end;
     
-    if (probe->used &&
-	!probe->responded &&
-	probe->nextRetransmission == 0 &&
-	probe->responseType != hopping_responseType_noResponse) {
-      
-      //
-      // This probe has not seen an answer yet, nor is there an ongoing
-      // retranmission for it yet. Check to see if it is time to send
-      // a retransmission.
-      //
-      
-      if (hopping_timeisless(&probe->initialTimeout,&now)) {
-	
-	//
-	// Yes. Timeout has passed. But should we retranmsit or rather
-	// send a new probe (if an additional new probe would bring
-	// new information)?
-	//
-	// And have we sent too many retries already?
-	//
-	
-	unsigned int triesSoFar = hopping_retries(probe);
-	debugf("Considering new retransmission of probe TTL %u, triesSoFar = %u, maxTries = %u",
-	       probe->hops,
-	       triesSoFar,
-	       maxTries);
-	
-	if (probe->newProbeSentInsteadOfRetransmission == 0&&
-	    !preferRetransmissionsOverNewProbes &&
-	    hopping_probesnotyetsentinrange(hopsMinInclusive,hopsMaxInclusive) &&
-	    hopping_shouldcontinuesending() &&
-	    probesSent < maxProbes) {
-	  
-	  //
-	  // There are more useful new probes to send. Send one.
-	  //
-	  
-	  unsigned long long prevTimeout;
-	  unsigned long long newTimeout;
-	  
-	  debugf("preferring new probe over retransmission of probe id %u ttl %u",
-		 probe->id, probe->hops);
-	  hopping_reportprogress_retransmissionconsidered(probe->id,probe->hops);
-	  probe->newProbeSentInsteadOfRetransmission =
-	    hopping_sendprobe(sd,destinationAddress,sourceAddress,0);
-	  
-	  //
-	  // Increase the current probe's timeout per exponential
-	  // backoff rules.
-	  //
-
-	  prevTimeout = hopping_timediffinusecs(&probe->initialTimeout,
-						&probe->sentTime);
-	  newTimeout = prevTimeout * HOPPING_RETRANSMISSION_BACKOFF_FACTOR;
-	  if (newTimeout > HOPPING_MAX_RETRANSMISSION_TIMEOUT_US)
-	    newTimeout = HOPPING_MAX_RETRANSMISSION_TIMEOUT_US;
-	  hopping_timeadd(&probe->sentTime,
-			  newTimeout,
-			  &probe->initialTimeout);
-	  
-	  //
-	  // Move over to the next probe
-	  //
-	  
-	  continue;
-	  
-	} else if (triesSoFar >= maxTries ||
-		   probesSent >= maxProbes) {
-	  
-	  //
-	  // Bailing out, have attempted to send too many
-	  // packets with this TTL already.
-	  //
-	  
-	  debugf("bailout, about to call reportprogress");
-	  hopping_reportprogress_noresponse(probe->id,probe->hops);
-	  debugf("bailout, about to call astimedout");
-	  hopping_markprobe_astimedout(probe);
-	  debugf("bailout, about to allow a new task to continue");
-	  hopping_bucket_releasetask();
-	  debugf("bailout, about to exit");
-	  
-	} else {
-	  
-	  //
-	  // Ok. Request a retranmission to be sent...
-	  //
-	  
-	  hopping_reportprogress_retransmissionconsidered(probe->id,probe->hops);
-	  hopping_retransmitactiveprobe(sd,
-					destinationAddress,
-					sourceAddress,
-					probe);
-	  probe->responseType = hopping_responseType_noResponse;
-	  
-	}
-      }
-      
-    }
+    while (isspace(*start)) start++;
+    end = start + strlen(start);
+    while (end > start && isspace(end[-1])) end--;
+    *end = '\0';
+    
+    if (*start == '\0' || *start == '#') continue;
+    
+    memmove(buffer,start,strlen(start)+1);
+    return(1);
     
   }
   
+  if (targetsInput != stdin) fclose(targetsInput);
+  targetsInput = 0;
+  return(0);
 }
 
 //
-// Construct and send a packet for a newly allocated probe
+// Create the search state for a new destination, and add it to the
+// set of active destinations. Returns 0 if the destination name
+// cannot be resolved.
 //
 
-static void
-hopping_sendprobeaux(int sd,
-		     struct sockaddr_in* destinationAddress,
-		     struct sockaddr_in* sourceAddress,
-		     unsigned int expectedLen,
-		     struct hopping_probe* probe) {
+static struct hopping_destination*
+hopping_newdestination(const char* name,
+		       unsigned int startTtl) {
+
+  struct hopping_destination* destination;
+
+  hopping_assert(name != 0);
   
-  unsigned int packetLength;
-  char* packet;
+  destination = (struct hopping_destination*)malloc(sizeof(*destination));
+  if (destination == 0) {
+    fatalf("cannot allocate memory for a destination");
+  }
+  memset(destination,0,sizeof(*destination));
   
-  hopping_assert(destinationAddress != 0);
-  hopping_assert(sourceAddress != 0);
-  hopping_assert(probe != 0);
+  destination->name = strdup(name);
+  if (destination->name == 0) {
+    fatalf("cannot allocate memory for a destination name");
+  }
+  
+  if (!hopping_getdestinationaddress(name,&destination->address)) {
+    free((void*)destination->name);
+    free(destination);
+    return(0);
+  }
+  debugf("destination = %s", hopping_iptostring(&destination->address));
   
   //
-  // Create a packet
+  // Initialize task counters and the search state
   //
   
-  hopping_constructicmp4packet(sourceAddress,
-			       destinationAddress,
-			       probe->id,
-			       probe->hops,
-			       icmpDataLength,
-			       &packet,
-			       &packetLength);
-  if (expectedLen != packetLength) {
-    fatalf("expected and resulting packet lengths do not agree (%u vs. %u)",
-	   expectedLen, packetLength);
+  hopping_bucket_initialize(destination,fingerprint ? 1 : parallel);
+  destination->probesSent = 0;
+  destination->hopsMinInclusive = 1;
+  destination->hopsMaxInclusive = 255;
+  if (algorithm == hopping_algorithms_bayes) {
+    hopping_bayes_initialize(destination);
+  }
+  hopping_getcurrenttime(&destination->startTime);
+  destination->nextProbeTime = destination->startTime;
+  hopping_timeadd(&destination->startTime,(unsigned long long)deadlineMs * 1000,&destination->deadline);
+  
+  //
+  // Adjust TTL if needed
+  //
+  
+  debugf("startTtl %u, maxTtl %u", startTtl, maxTtl);
+  if (startTtl > maxTtl) {
+    startTtl = maxTtl;
+    debugf("reset startTtl to %u", startTtl);
+  }
+  
+  if (algorithm == hopping_algorithms_reversesequential &&
+      startTtl < maxTtl) {
+    
+    startTtl = maxTtl;
+    debugf("reset startTtl to %u", startTtl);
+    
   }
   
+  destination->currentTtl = startTtl;
+  
   //
-  // Send the packet
+  // Reserve probe entries for the destination, and add it to the
+  // active set
   //
   
-  hopping_sendpacket(sd,
-		     packet,
-		     packetLength,
-		     (struct sockaddr *)destinationAddress,
-		     sizeof (struct sockaddr));
+  probeSlotsReserved += maxProbes;
+  destination->next = activeDestinations;
+  activeDestinations = destination;
+  nActiveDestinations++;
+  
+  return(destination);
 }
 
 //
-// Get a likely number of hops value for binary search
-// start value, instead of blindly selecting 128 as the
-// middle of the theoretical field. The 128 value is
-// unlikely to be a real max TTL value in most cases.
+// Report the results for one destination. In batch mode each
+// destination gets one line.
 //
 
-static unsigned char
-hopping_bestinitialguess(unsigned char from,
-			 unsigned char to) {
-  unsigned char selected = HOPPING_TYPICAL_INTERNET_HOP_COUNT + 1;
-  if (selected < from) selected = from;
-  if (selected > to) selected = to;
-  return(selected);
-}
+static void
+hopping_reportResult(struct hopping_destination* destination) {
+
+  hopping_assert(destination != 0);
   
+  if (targetsFile == 0) {
+    hopping_reportprogress_end();
+    if (conclusion) {
+      hopping_reportConclusion(destination);
+    }
+    hopping_reportStats(destination);
+    return;
+  }
+
+  if (machineReadable) {
+    printf("%s:", destination->name);
+  }
+  hopping_reportConclusionAux(destination);
+  if (briefStatistics) {
+    if (machineReadable) {
+      printf(":%u", hopping_count_probes_sent(destination));
+    } else {
+      printf(", %u probes sent", hopping_count_probes_sent(destination));
+    }
+  }
+  hopping_reportConclusionEstimate(destination);
+  printf("\n");
+  if (fullStatistics) {
+    hopping_reportStatsFull(destination);
+  }
+  fflush(stdout);
+}
+
 //
-// Get a likely number of hops value for binary search
-// start value, for probes that are not the first probe
-// but when we have not yet received any responses, so
-// there is no knowledge of the search space reducing at
-// all yet.
+// Report a destination in the targets file that could not be
+// resolved
 //
 
-static unsigned char
-hopping_bestinitialotherguess(unsigned char from,
-			      unsigned char to,
-			      hopping_ttl_test_function suitableTestFunction,
-			      unsigned int numberOfTests) {
-  return(hopping_bestbinarysearchvalue(HOPPING_TYPICAL_INTERNET_MIN_HOP_COUNT,
-				       HOPPING_TYPICAL_INTERNET_MAX_HOP_COUNT,
-				       suitableTestFunction,
-				       numberOfTests));
+static void
+hopping_reportUnresolved(const char* name) {
+  if (machineReadable) {
+    printf("%s:unknown:unresolved", name);
+    if (briefStatistics) printf(":0");
+    printf("\n");
+  } else {
+    printf("%s cannot be resolved\n", name);
+  }
+  fflush(stdout);
 }
-  
+
 //
-// Get a new search value in the possible range of values,
-// based on binary (or tertiary or ...) search algorithm.
+// Report the results for a destination that has completed, and
+// release its resources
 //
 
-static unsigned char
-hopping_bestbinarysearchvalue(unsigned char from,
-			      unsigned char to,
-			      hopping_ttl_test_function suitableTestFunction,
-			      unsigned int numberOfTests) {
-  
-  unsigned char available[256];
-  unsigned int nAvailable = 0;
-  unsigned int i;
-  unsigned char candidate;
+static void
+hopping_finishdestination(struct hopping_destination* destination) {
 
-  //
-  // Sanity tests
-  //
+  struct hopping_destination** pointer;
 
-  debugf("hopping_bestbinarysearchvalue start %u..%u", from, to);
-  hopping_assert(from <= to);
-  hopping_assert(suitableTestFunction != 0);
-  hopping_assert(numberOfTests > 0);
+  hopping_assert(destination != 0);
   
-  //
-  // First, collect the items in the range from..to that satisfy
-  // the test function
-  //
+  hopping_reportResult(destination);
+  if (distributionFile != 0) {
+    hopping_learndistribution(destination);
+  }
+  hopping_freeprobes(destination);
   
-  for (i = (unsigned int)from; i <= (unsigned int)to; i++) {
-    unsigned char ttl = (unsigned char)i;
-    if ((*suitableTestFunction)(ttl)) {
-      hopping_assert(nAvailable <= 255);
-      available[nAvailable++] = ttl;
-      debugf("TTL %u available, increasing navailable to %u", ttl, nAvailable);
+  for (pointer = &activeDestinations; *pointer != 0; pointer = &(*pointer)->next) {
+    if (*pointer == destination) {
+      *pointer = destination->next;
+      break;
     }
   }
-  debugf("navailable finally %u", nAvailable);
   
-  //
-  // Then, figure out what items in the list deserve to be
-  // picked, based on how many tests we have available.
-  // For instance, with one test available we would halve
-  // the search space, with two we divide it to three,
-  // with three divide to four, etc.
-  //
+  hopping_assert(nActiveDestinations > 0);
+  hopping_assert(probeSlotsReserved >= maxProbes);
+  nActiveDestinations--;
+  probeSlotsReserved -= maxProbes;
+  free((void*)destination->name);
+  free(destination);
+}
 
-  if (probabilisticDistribution) {
+//
+// Start measuring new destinations from the targets file, as long as
+// there is room for them
+//
 
-    //
-    // Probabilistic distribution based on likelihoods of different hop counts
-    //
-    
-    double candidateProbabilityPosition = 1.0 / (numberOfTests+1.0);
-    debugf("hopping_bestbinarysearchvalue candidate probability %f navailable %u numberoftests %u",
-	   candidateProbabilityPosition,
-	   nAvailable,
-	   numberOfTests);
-    hopping_assert(candidateProbabilityPosition >= -0.01);
-    hopping_assert(candidateProbabilityPosition <=  1.01);
-    candidate = hopping_selectfromdistribution(candidateProbabilityPosition,
-					       available,
-					       nAvailable);
-    
-  } else {
-    
-    //
-    // Plain distribution based on actual numbers
-    //
+static void
+hopping_admitdestinations(unsigned int startTtl) {
+
+  char name[HOPPING_MAX_TARGET_LINE];
+  
+  while (!interrupt &&
+	 targetsInput != 0 &&
+	 (nActiveDestinations == 0 ||
+	  (nActiveDestinations < concurrentDestinations &&
+	   probeSlotsReserved + maxProbes <= probeTableSize))) {
     
-    unsigned char candidateIndex = nAvailable / (numberOfTests+1);
-    debugf("hopping_bestbinarysearchvalue candidate %u navailable %u numberoftests %u",
-	   candidateIndex,
-	   nAvailable,
-	   numberOfTests);
-    hopping_assert(candidateIndex < nAvailable);
-    candidate = available[candidateIndex];
+    if (!hopping_readtarget(name,sizeof(name))) break;
+    debugf("starting destination %s", name);
+    if (hopping_newdestination(name,startTtl) == 0) {
+      hopping_reportUnresolved(name);
+    }
     
   }
   
-  debugf("binary search picks candidate %u from a pool of %u available candidates (number of tests = %u)",
-	 candidate, nAvailable, numberOfTests);
-  
-  //
-  // Done. Return the candidate
-  //
-  
-  return(candidate);
 }
 
 //
-// Re-initialize currentTtl to the currently learned range
+// Report and remove the destinations whose search has completed
 //
 
-static unsigned char
-hopping_readjusttolearnedrange(int fromthetop) {
+static void
+hopping_finishdestinations(void) {
 
-  if (readjust) {
-    unsigned char newValue = fromthetop ? hopsMaxInclusive : hopsMinInclusive;
-    debugf("readjusted currentTtl to %u (in range %u..%u)",
-	   newValue, hopsMinInclusive, hopsMaxInclusive);
-    return(newValue);
-  } else {
-    return(currentTtl);
-  }
+  struct hopping_destination* destination = activeDestinations;
 
+  while (destination != 0) {
+    struct hopping_destination* next = destination->next;
+    if (!hopping_shouldcontinuesendingorwaiting(destination)) {
+      hopping_finishdestination(destination);
+    }
+    destination = next;
+  }
+  
 }
 
 //
-// Create send one new probe
+// Find the earliest time at which something needs to be done: a new
+// (possibly paced) probe can be sent, a probe times out, or a
+// destination reaches its maximum waiting time.
 //
 
-static struct hopping_probe*
-hopping_sendprobe(int sd,
-		  struct sockaddr_in* destinationAddress,
-		  struct sockaddr_in* sourceAddress,
-		  int inbucket) {
-  
-  struct hopping_probe* probe;
-  unsigned int expectedLen;
-  hopping_idtype id;
+static void
+hopping_nextdeadline(struct timeval* deadline) {
+
+  struct hopping_destination* destination;
+  struct timeval candidate;
+  struct timeval now;
+  int found = 0;
+
+  hopping_assert(deadline != 0);
   
-  //
-  // Depending on algorithm, adjust behaviour
-  //
+  hopping_getcurrenttime(&now);
   
-  switch (algorithm) {
-    
-  case hopping_algorithms_random:
-    
-    debugf("before random selection, min = %u and max = %u",
-	   hopsMinInclusive, hopsMaxInclusive);
-    
-    do {
-      
-      //
-      // Random pick
-      //
-      
-      currentTtl = (unsigned char)(((unsigned int)hopsMinInclusive +
-				    (rand() % (((unsigned int)hopsMaxInclusive) - ((unsigned int)hopsMinInclusive) + 1))));
-      
-      //
-      // If we've already sent probes on all TTLs in the current possible range of
-      // TTLs, then just pick this random number and go with it!
-      //
-      
-      if (hopping_countprobes_notsentinrange(hopsMinInclusive,hopsMaxInclusive)) break;
-      
-      //
-      // If we've already sent a probe with this TTL earlier, pick another
-      //
-      
-      if (hopping_thereisprobe_ttl(currentTtl)) continue;
-      
-    } while (1);
-    
-    debugf("selected a random ttl %u in range %u..%u", currentTtl, hopsMinInclusive, hopsMaxInclusive);
-    break;
-    
-  case hopping_algorithms_sequential:
-    
-    //
-    // Increase by one (unless this is the first probe
-    //
-    
-    if (probesSent > 0 && currentTtl < 255) currentTtl++;
-    
+  for (destination = activeDestinations;
+       destination != 0;
+       destination = destination->next) {
+
     //
-    // If value falls outside currently learned range, readjust
+    // A destination that is done has nothing to wait for; it is
+    // finished on the next pass of the loop
     //
     
-    if (currentTtl < hopsMinInclusive ||
-	currentTtl > hopsMaxInclusive) {
-      
-      currentTtl = hopping_readjusttolearnedrange(0);
-      
+    if (!hopping_shouldcontinuesendingorwaiting(destination)) {
+      if (!found || hopping_timeisless(&now,deadline)) *deadline = now;
+      found = 1;
+      continue;
     }
     
     //
-    // Done
+    // Next new probe
     //
     
-    debugf("selected one larger ttl %u", currentTtl);
-    break;
-    
-  case hopping_algorithms_reversesequential:
-    
+    if (hopping_bucket_cantakeontask(destination) &&
+	hopping_round_cansend(destination) &&
+	hopping_shouldcontinuesending(destination)) {
+      candidate = destination->nextProbeTime;
+      if (!found || hopping_timeisless(&candidate,deadline)) *deadline = candidate;
+      found = 1;
+    }
+
     //
-    // Decrease by one (unless this is the first probe
+    // Next redundant copy of a probe
     //
     
-    if (probesSent > 0 && currentTtl > 0) currentTtl--;
+    if (destination->redundancyPending > 0) {
+      candidate = destination->redundancyTime;
+      if (!found || hopping_timeisless(&candidate,deadline)) *deadline = candidate;
+      found = 1;
+    }
     
     //
-    // If value falls outside currently learned range, readjust
+    // Deadline of the destination
     //
     
-    if (currentTtl < hopsMinInclusive ||
-	currentTtl > hopsMaxInclusive) {
-      
-      currentTtl = hopping_readjusttolearnedrange(1);
-      
+    if (deadlineMs > 0) {
+      candidate = destination->deadline;
+      if (!found || hopping_timeisless(&candidate,deadline)) *deadline = candidate;
+      found = 1;
     }
     
     //
-    // Done
+    // End of the maximum wait (see
+    // hopping_shouldcontinuesendingorwaiting). Once it has
+    // passed, only the probe timeouts matter.
     //
     
-    debugf("selected one smaller ttl %u", currentTtl);
-    break;
-    
-  case hopping_algorithms_binarysearch:
-    
-    if (likelyCandidates && probesSent == 0) {
-      
-      currentTtl = hopping_bestinitialguess(hopsMinInclusive,hopsMaxInclusive);
-      
-    } else if (likelyCandidates &&
-	       hopping_responses() == 0 &&
-	       probesSent < HOPPING_N_TYPICAL_HOP_COUNT_TRIES) {
-      
-      currentTtl = hopping_bestinitialotherguess(hopsMinInclusive,
-						 hopsMaxInclusive,
-						 hopping_thereisnoprobe_ttl,
-						 inbucket ? bucket : 1);
-      
-    } else {
-      
-      currentTtl = hopping_bestbinarysearchvalue(hopsMinInclusive,
-						 hopsMaxInclusive,
-						 hopping_thereisnoprobe_ttl,
-						 inbucket ? bucket : 1);
-      
+    candidate.tv_sec = destination->startTime.tv_sec + maxWait + 1;
+    candidate.tv_usec = 0;
+    if (hopping_timeisless(&now,&candidate)) {
+      if (!found || hopping_timeisless(&candidate,deadline)) *deadline = candidate;
+      found = 1;
     }
-    break;
     
-  default:
-    fatalf("invalid internal algorithm identifier");
-      
   }
   
   //
-  // Create a packet and send it
+  // Probe timeouts
   //
   
-  id = hopping_getnewid(currentTtl);
-  expectedLen = HOPPING_IP4_HDRLEN + HOPPING_ICMP4_HDRLEN + icmpDataLength;
-  probe = hopping_newprobe(id,currentTtl,expectedLen,0);
-  if (probe == 0) {
-    fatalf("cannot allocate a new probe entry");
+  if (hopping_timer_nextdeadline(&candidate)) {
+    if (!found || hopping_timeisless(&candidate,deadline)) *deadline = candidate;
+    found = 1;
   }
-  
-  hopping_sendprobeaux(sd,
-		       destinationAddress,
-		       sourceAddress,
-		       expectedLen,
-		       probe);
-  
+
+  if (!found) *deadline = now;
+}
+
+//
+// Sleep until the receive socket becomes readable or the next
+// deadline passes. Returns 1 if the receive socket is readable.
+//
+
+static int
+hopping_waitforevents(int epfd,
+		      int tfd,
+		      int rd) {
+
+  struct epoll_event events[HOPPING_MAX_EVENTS];
+  struct itimerspec timer;
+  struct timeval deadline;
+  struct timeval now;
+  int readable = 0;
+  int timeout;
+  int n;
+  int i;
+
   //
-  // Report progress on screen
+  // Arm the timer for the next deadline, or just poll if the
+  // deadline has already passed
   //
   
-  hopping_reportprogress_sent(id,probe->hops,0);
-
+  hopping_nextdeadline(&deadline);
+  hopping_getcurrenttime(&now);
+  memset(&timer,0,sizeof(timer));
+  
+  if (hopping_timeisless(&now,&deadline)) {
+    unsigned long long us = hopping_timediffinusecs(&deadline,&now);
+    timer.it_value.tv_sec = us / (1000 * 1000);
+    timer.it_value.tv_nsec = (us % (1000 * 1000)) * 1000;
+    timeout = -1;
+  } else {
+    timeout = 0;
+  }
+  
+  if (timerfd_settime(tfd,0,&timer,0) < 0) {
+    fatalp("timerfd_settime() failed");
+  }
+  
   //
-  // Done. Return the probe.
+  // Wait
   //
   
-  return(probe);
+  debugf("going into epoll_wait for %lu s %lu ns",
+	 timer.it_value.tv_sec, timer.it_value.tv_nsec);
+  n = epoll_wait(epfd,events,HOPPING_MAX_EVENTS,timeout);
+  if (n < 0) {
+    if (errno == EINTR) return(0);
+    fatalp("epoll_wait() failed");
+  }
+  
+  for (i = 0; i < n; i++) {
+    if (events[i].data.fd == rd) {
+      readable = 1;
+    } else if (events[i].data.fd == tfd) {
+      uint64_t expirations;
+      if (read(tfd,&expirations,sizeof(expirations)) < 0 &&
+	  errno != EAGAIN) {
+	fatalp("cannot read from timerfd");
+      }
+    }
+  }
+  
+  return(readable);
 }
 
 //
-// Send as many probes as we are allowed to send
+// Find the destination that a probe id belongs to
 //
 
-static void
-hopping_sendprobes(int sd,
-		   struct sockaddr_in* destinationAddress,
-		   struct sockaddr_in* sourceAddress) {
+static struct hopping_destination*
+hopping_probedestination(hopping_idtype id) {
+
+  struct hopping_probe* probe;
+  
+  if (id >= probeTableSize) return(0);
+  probe = &probes[id];
+  if (!probe->used) return(0);
+  return(probe->destination);
+}
+
+//
+// Process a batch of received packets: validate each, find the
+// destination it belongs to, and register the response.
+//
 
-  //
-  // If there's room in the "bucket", send more new probes
-  //
+static void
+hopping_processpackets(char** receivedPackets,
+		       int* receivedPacketLengths,
+		       struct timeval* receivedTimes,
+		       int* receivedKernelTimes,
+		       int n,
+		       struct sockaddr_in* sourceAddress) {
+  
+  enum hopping_responseType responseType;
+  struct hopping_probe* responseToProbe;
+  struct hopping_destination* destination;
+  struct ip responseToIpHdr;
+  struct icmp responseToIcmpHdr;
+  hopping_idtype responseId;
+  uint16_t responseWireId;
+  uint16_t responseWireSeq;
+  unsigned char responseTtl;
+  int i;
   
-  if (hopping_bucket_cantakeontask() &&
-      hopping_shouldcontinuesending()) {
+  for (i = 0; i < n; i++) {
     
-    struct hopping_probe* probe =
-      hopping_sendprobe(sd,destinationAddress,sourceAddress,1);
-    hopping_bucket_taketask();
+    debugf("received a packet of %u bytes", receivedPacketLengths[i]);
+    
+    //
+    // Verify response packet (that it is for us, long enough, etc.)
+    //
+    
+    if (!hopping_validatepacket(receivedPackets[i],
+				receivedPacketLengths[i],
+				&responseType,
+				&responseWireId,
+				&responseWireSeq,
+				&responseTtl,
+				&responseToIpHdr,
+				&responseToIcmpHdr)) {
+      
+      debugf("invalid packet, ignoring");
+      hopping_reportprogress_received_other();
+      
+    } else if (!hopping_matchprobe(responseWireId,responseWireSeq,&responseId) ||
+	       (destination = hopping_probedestination(responseId)) == 0 ||
+	       !hopping_packetisforus(receivedPackets[i],
+				      receivedPacketLengths[i],
+				      responseType,
+				      sourceAddress,
+				      destination,
+				      &responseToIpHdr,
+				      &responseToIcmpHdr)) {
+      
+      debugf("packet not for us, ignoring");
+      hopping_reportprogress_received_other();
+      
+    } else {
+      
+      debugf("packet was for us, taking into account");
+      
+      //
+      // Register the response into our own database
+      //
+      
+      hopping_registerResponse(responseType,
+			       responseId,
+			       responseTtl,
+			       receivedPacketLengths[i],
+			       &receivedTimes[i],
+			       receivedKernelTimes[i],
+			       &responseToProbe);
+      hopping_reportprogress_received(destination,
+				      responseType,
+				      responseId,
+				      responseToProbe != 0 ? responseToProbe->hops : 0);
+      
+    }
     
   }
-  
-  //
-  // If there are probes whose response has not arrived and their
-  // timeouts expire, send retransmissions
-  //
-  
-  hopping_retransmitactiveprobes(sd,
-				 destinationAddress,
-				 sourceAddress);
-  
 }
 
 //
@@ -2408,148 +6292,134 @@ hopping_sendprobes(int sd,
 static void
 hopping_probingprocess(int sd,
 		       int rd,
-		       struct sockaddr_in* destinationAddress,
 		       struct sockaddr_in* sourceAddress,
 		       unsigned int startTtl) {
   
-  enum hopping_responseType responseType;
-  struct hopping_probe* responseToProbe;
-  hopping_idtype responseId;
-  unsigned char responseTtl;
-  int receivedPacketLength;
-  char* receivedPacket;
+  struct hopping_destination* destination;
+  char* receivedPackets[HOPPING_RECEIVE_BATCH];
+  int receivedPacketLengths[HOPPING_RECEIVE_BATCH];
+  struct timeval receivedTimes[HOPPING_RECEIVE_BATCH];
+  int receivedKernelTimes[HOPPING_RECEIVE_BATCH];
+  int nReceived;
+  struct epoll_event event;
+  int epfd;
+  int tfd;
 
   //
-  // Initialize task counters
+  // Set up the event loop: the receive socket, and a timer for
+  // the next retransmission or pacing deadline
   //
 
-  hopping_bucket_initialize(parallel);
-  
-  //
-  // Adjust TTL if needed
-  //
-  
-  debugf("startTtl %u, maxTtl %u", startTtl, maxTtl);
-  if (startTtl > maxTtl) {
-    startTtl = maxTtl;
-    debugf("reset startTtl to %u", startTtl);
+  hopping_timer_initialize();
+  hopping_initreceivebuffers();
+  hopping_initsendbuffers();
+
+  if ((epfd = epoll_create1(0)) < 0) {
+    fatalp("epoll_create1() failed");
   }
-  
-  if (algorithm == hopping_algorithms_reversesequential &&
-      startTtl < maxTtl) {
-    
-    startTtl = maxTtl;
-    debugf("reset startTtl to %u", startTtl);
-    
+  if ((tfd = timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK)) < 0) {
+    fatalp("timerfd_create() failed");
   }
   
-  currentTtl = startTtl;
+  memset(&event,0,sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = rd;
+  if (epoll_ctl(epfd,EPOLL_CTL_ADD,rd,&event) < 0) {
+    fatalp("epoll_ctl() failed for the receive socket");
+  }
+  event.data.fd = tfd;
+  if (epoll_ctl(epfd,EPOLL_CTL_ADD,tfd,&event) < 0) {
+    fatalp("epoll_ctl() failed for the timer");
+  }
   
   //
   // Loop
   //
 
-  while (hopping_shouldcontinuesendingorwaiting()) {
+  while (1) {
     
-    struct ip responseToIpHdr;
-    struct icmp responseToIcmpHdr;
-    int firstReception = 1;
+    //
+    // Start new destinations and complete the ones that are done
+    //
+    
+    hopping_admitdestinations(startTtl);
+    hopping_finishdestinations();
+    if (activeDestinations == 0) {
+      if (targetsInput != 0 && !interrupt) continue;
+      else break;
+    }
     
     //
     // Send as many probes as we can
     //
     
-    hopping_sendprobes(sd,
-		       destinationAddress,
-		       sourceAddress);
+    for (destination = activeDestinations;
+	 destination != 0;
+	 destination = destination->next) {
+      hopping_sendprobes(sd,
+			 destination,
+			 sourceAddress);
+    }
     
     //
-    // Get as many responses as you can. On the first
-    // call to hopping_receivepacket, we will wait if there's
-    // no packet. On the second and subsequent calls we don't
-    // wait, until we've again sent some probes.
+    // If there are probes whose response has not arrived and their
+    // timeouts expire, send retransmissions
     //
     
-    while ((receivedPacketLength = hopping_receivepacket(rd,
-							 &receivedPacket,
-							 firstReception,
-							 (hopping_bucket_cantakeontask() &&
-							  hopping_shouldcontinuesendingorwaiting()))) > 0) {
-      
-      debugf("received a packet of %u bytes", receivedPacketLength);
-      
-      //
-      // Verify response packet (that it is for us, long enough, etc.)
-      //
-      
-      if (!hopping_validatepacket(receivedPacket,
-				  receivedPacketLength,
-				  &responseType,
-				  &responseId,
-				  &responseTtl,
-				  &responseToIpHdr,
-				  &responseToIcmpHdr)) {
-	
-	debugf("invalid packet, ignoring");
-	hopping_reportprogress_received_other();
-	
-      } else if (!hopping_packetisforus(receivedPacket,
-					receivedPacketLength,
-					responseType,
-					sourceAddress,
-					destinationAddress,
-					&responseToIpHdr,
-					&responseToIcmpHdr)) {
-	
-	debugf("packet not for us, ignoring");
-	hopping_reportprogress_received_other();
-	
-      } else {
-	
-	debugf("packet was for us, taking into account");
-	
-	//
-	// Register the response into our own database
-	//
-	
-	hopping_registerResponse(responseType,
-				 responseId,
-				 responseTtl,
-				 receivedPacketLength,
-				 &responseToProbe);
-	hopping_reportprogress_received(responseType,
-					responseId,
-					responseToProbe != 0 ? responseToProbe->hops : 0);
-	
-      }
-      
-      //
-      // Loop through any additional packets we might have received;
-      // don't however wait for them.
-      //
-      
-      firstReception = 0;
-      
-    }
-
+    hopping_retransmitactiveprobes(sd,
+				   sourceAddress);
+    
     //
-    // We did not get a packet, but got a timeout instead
+    // Send everything that was queued above in one go
     //
     
+    hopping_flushpackets(sd);
+    hopping_receivetimestamps(sd);
+    
+    //
+    // Giving up on the last probes may have completed destinations
+    //
+    
+    hopping_finishdestinations();
+    
+    //
+    // Sleep until a response arrives or the next deadline
+    // passes. Then get as many responses as there are.
+    //
+    
+    if (!hopping_waitforevents(epfd,tfd,rd)) continue;
+    
+    do {
+      
+      nReceived = hopping_receivepackets(rd,
+					 receivedPackets,
+					 receivedPacketLengths,
+					 receivedTimes,
+					 receivedKernelTimes);
+      hopping_receivetimestamps(sd);
+      hopping_processpackets(receivedPackets,
+			     receivedPacketLengths,
+			     receivedTimes,
+			     receivedKernelTimes,
+			     nReceived,
+			     sourceAddress);
+      
+    } while (nReceived == HOPPING_RECEIVE_BATCH);
+    
   }
-  
-  hopping_reportprogress_end();
-  
+
+  close(tfd);
+  close(epfd);
 }
 
 //
-// The main program for starting a test
+// The main program for starting a test. All destinations share the
+// same pair of raw sockets.
 //
 
 static void
 hopping_runtest(unsigned int startTtl,
-		const char* interface,
-		const char* destination) {
+		const char* interface) {
 
   struct sockaddr_in sourceAddress;
   struct sockaddr_in bindAddress;
@@ -2564,7 +6434,11 @@ hopping_runtest(unsigned int startTtl,
   //
   
   hopping_getifindex(interface,&ifindex,&ifr,&sourceAddress);
-  hopping_getdestinationaddress(destination,&testDestinationAddress);
+  hopping_initprobes();
+  if (targetsFile == 0 &&
+      hopping_newdestination(testDestination,startTtl) == 0) {
+    exit(1);
+  }
   
   //
   // Debugs
@@ -2572,7 +6446,6 @@ hopping_runtest(unsigned int startTtl,
   
   debugf("ifindex = %d", ifindex);
   debugf("source = %s", hopping_iptostring(&sourceAddress));
-  debugf("destination = %s", hopping_iptostring(&testDestinationAddress));
   
   //
   // Get an output raw socket
@@ -2605,12 +6478,20 @@ hopping_runtest(unsigned int startTtl,
   if (bind(rd, (struct sockaddr*) &bindAddress, sizeof(bindAddress)) == -1) {
     fatalp("cannot bind input raw socket");
   }
+  
+  hopping_attachfilter(rd,&sourceAddress);
 
+  //
+  // Ask the kernel to timestamp the probes and responses
+  //
+  
+  hopping_enablekerneltimestamps(sd,rd);
+  
   //
   // Start the main loop
   //
   
-  hopping_probingprocess(sd,rd,&testDestinationAddress,&sourceAddress,startTtl);
+  hopping_probingprocess(sd,rd,&sourceAddress,startTtl);
   
   //
   // Done. Return.
@@ -2622,12 +6503,185 @@ hopping_runtest(unsigned int startTtl,
 // Probability distributions -------------------------------------------------
 //
 
+static void
+hopping_computecumulativedistribution(void) {
+
+  unsigned int i;
+
+  hopscumulativedistribution[0] = 0.0;
+  for (i = 0; i < 256; i++) {
+    hopscumulativedistribution[i + 1] =
+      hopscumulativedistribution[i] + hopsprobabilitydistribution[i] / 100.0;
+  }
+}
+
+//
+// Make sure that no hop count has a zero probability, and that the
+// probabilities sum up to 100%
+//
+
+static void
+hopping_normalizedistribution(void) {
+
+  double sum = 0.0;
+  unsigned int i;
+
+  for (i = 0; i < 256; i++) {
+    if (hopsprobabilitydistribution[i] < HOPPING_DISTRIBUTION_MIN_LIKELY) {
+      hopsprobabilitydistribution[i] = HOPPING_DISTRIBUTION_MIN_LIKELY;
+    }
+    sum += hopsprobabilitydistribution[i];
+  }
+  
+  for (i = 0; i < 256; i++) {
+    hopsprobabilitydistribution[i] *= 100.0 / sum;
+  }
+}
+
+//
+// Read the hop count distribution from a file. Each line has a hop
+// count and its probability in percent; empty lines and lines
+// starting with # are ignored. Hop counts that are not listed get the
+// minimum probability, and the probabilities are normalized to sum
+// up to 100%. Returns 0 if the file does not exist.
+//
+
+static int
+hopping_loaddistribution(const char* fileName) {
+
+  char buffer[HOPPING_MAX_DISTRIBUTION_LINE];
+  unsigned int line = 0;
+  unsigned int entries = 0;
+  FILE* input;
+  
+  hopping_assert(fileName != 0);
+  
+  if ((input = fopen(fileName,"r")) == 0) {
+    if (errno == ENOENT) return(0);
+    fatalf("cannot open distribution file %s", fileName);
+  }
+  
+  memset(hopsprobabilitydistribution,0,sizeof(hopsprobabilitydistribution));
+  
+  while (fgets(buffer,sizeof(buffer),input) != 0) {
+    
+    char* start = buffer;
+    unsigned int ttl;
+    double probability;
+    char extra;
+    
+    line++;
+    while (isspace(*start)) start++;
+    if (*start == '\0' || *start == '#') continue;
+    
+    if (sscanf(start,"%u %lf %c",&ttl,&probability,&extra) != 2 ||
+	ttl > 255 ||
+	probability < 0.0 ||
+	probability > 100.0) {
+      fatalf("invalid line %u in distribution file %s", line, fileName);
+    }
+    
+    hopsprobabilitydistribution[ttl] = probability;
+    entries++;
+    
+  }
+  
+  fclose(input);
+  if (entries == 0) {
+    fatalf("no hop counts in distribution file %s", fileName);
+  }
+  
+  hopping_normalizedistribution();
+  debugf("read %u hop counts from distribution file %s", entries, fileName);
+  return(1);
+}
+
+//
+// Write the hop count distribution to a file, in the format read by
+// hopping_loaddistribution(). The file is written under a temporary
+// name and then renamed, so that a concurrent reader never sees a
+// partial file.
+//
+
+static void
+hopping_savedistribution(const char* fileName) {
+
+  char* tempName;
+  FILE* output;
+  unsigned int i;
+  
+  hopping_assert(fileName != 0);
+  
+  tempName = (char*)malloc(strlen(fileName) + 5);
+  if (tempName == 0) {
+    fatalf("cannot allocate memory for a file name");
+  }
+  sprintf(tempName,"%s.tmp",fileName);
+  
+  if ((output = fopen(tempName,"w")) == 0) {
+    fatalf("cannot write distribution file %s", tempName);
+  }
+  
+  fprintf(output,"# hopping hop count distribution\n");
+  fprintf(output,"# hop count, probability (%%)\n");
+  for (i = 0; i < 256; i++) {
+    fprintf(output,"%u %.6f\n", i, hopsprobabilitydistribution[i]);
+  }
+  
+  if (fclose(output) != 0 || rename(tempName,fileName) != 0) {
+    fatalf("cannot write distribution file %s", fileName);
+  }
+  
+  debugf("wrote distribution file %s", fileName);
+  free(tempName);
+}
+
+//
+// Learn from a completed measurement: if the hop count of the
+// destination was determined, move the distribution towards it. The
+// weight of earlier measurements decays by distributionDecay for
+// every new one.
+//
+
+static void
+hopping_learndistribution(struct hopping_destination* destination) {
+
+  unsigned char hops;
+  unsigned int i;
+  
+  hopping_assert(destination != 0);
+  
+  if (destination->hopsMinInclusive != destination->hopsMaxInclusive) return;
+  hops = destination->hopsMinInclusive;
+  
+  for (i = 0; i < 256; i++) {
+    hopsprobabilitydistribution[i] *= distributionDecay;
+  }
+  hopsprobabilitydistribution[hops] += 100.0 * (1.0 - distributionDecay);
+  hopping_normalizedistribution();
+  hopping_computecumulativedistribution();
+  
+  debugf("learned hop count %u, its probability is now %f%%",
+	 hops, hopsprobabilitydistribution[hops]);
+}
+
+//
+// Set up the hop count distribution, either the built-in one or one
+// read from the distribution file
+//
+
 static void
 hopping_initdistribution() {
 
   float sum = 0.0;
   unsigned int i;
 
+  if (distributionFile != 0 &&
+      !hopping_loaddistribution(distributionFile)) {
+    debugf("distribution file %s does not exist yet, starting from the built-in distribution",
+	   distributionFile);
+  }
+  
   for (i = 0; i < 256; i++) {
     sum += hopsprobabilitydistribution[i];
   }
@@ -2636,82 +6690,142 @@ hopping_initdistribution() {
   
   hopping_assert(sum >=  99.99 &&
 		 sum <= 100.01);
+  
+  hopping_computecumulativedistribution();
+}
+
+//
+// The probability that the hop count is within from..to (inclusive)
+//
+
+static double
+hopping_distributionmass(unsigned char from,
+			 unsigned char to) {
+  hopping_assert(from <= to);
+  return(hopscumulativedistribution[to + 1] - hopscumulativedistribution[from]);
+}
+
+//
+// The probability that the hop count is one of the TTLs within
+// from..to (inclusive) that are in a set
+//
+
+static double
+hopping_distributionmaskedmass(unsigned char from,
+			       unsigned char to,
+			       const uint64_t* set) {
+  
+  double mass = 0.0;
+  unsigned int word;
+  
+  hopping_assert(from <= to);
+  hopping_assert(set != 0);
+  
+  for (word = from / 64; word <= (unsigned int)to / 64; word++) {
+    
+    unsigned int low = (word == from / 64) ? from % 64 : 0;
+    unsigned int high = (word == (unsigned int)to / 64) ? to % 64 : 63;
+    uint64_t mask = (high == 63 ? ~0ULL : ((1ULL << (high + 1)) - 1)) & ~((1ULL << low) - 1);
+    uint64_t bits = set[word] & mask;
+    
+    while (bits != 0) {
+      unsigned int ttl = word * 64 + __builtin_ctzll(bits);
+      mass += hopping_distributionmass(ttl,ttl);
+      bits &= bits - 1;
+    }
+    
+  }
+  
+  return(mass);
 }
 
 //
-// Choose a candidate among a set of hop count choices (choices and
-// nChoices), such that the given probability position
+// Choose a candidate among the hop counts from..to that are not in
+// the excluded set, such that the given probability position
 // (probabilityPosition, e.g., 0.50) most closely matches the
-// likelihood of the given choices. For instance, if there are three
-// choices, and their probability as an Internet hop count is 1%, 1%,
-// and 50%, then the total probabilities within the set of three is
-// 52%. A probability position of 0.01 would result in choosing the
-// first element, and a probability position of 0.33 would result in
-// choosing the third element.
+// likelihood of the candidates. For instance, if there are three
+// candidates, and their probability as an Internet hop count is 1%,
+// 1%, and 50%, then the total probabilities within the set of three
+// is 52%. A probability position of 0.01 would result in choosing
+// the first candidate, and a probability position of 0.33 would
+// result in choosing the third candidate.
+//
+// The probabilities come from the cumulative distribution, less
+// those of the excluded hop counts, so the chosen hop count can be
+// found by binary search.
 //
 
 static unsigned char
 hopping_selectfromdistribution(double probabilityPosition,
-			       unsigned char* choices,
-			       unsigned int nChoices) {
-  double normalizationFactor;
+			       unsigned char from,
+			       unsigned char to,
+			       const uint64_t* excluded) {
   double probabilitySum;
-  double probabilityNow;
-  unsigned int i;
+  double target;
+  unsigned int low;
+  unsigned int high;
+  unsigned int choice;
 
-  debugf("hopping_selectfromdistribution %f out of %u choices", probabilityPosition, nChoices);
-  hopping_assert(nChoices > 0);
+  debugf("hopping_selectfromdistribution %f out of %u..%u", probabilityPosition, from, to);
+  hopping_assert(from <= to);
+  hopping_assert(excluded != 0);
   hopping_assert(probabilityPosition > -0.01);
   hopping_assert(probabilityPosition <  1.01);
   
   //
-  // Calculate the sum of all probabilities for the given
-  // hop count choices.
+  // Calculate the sum of all probabilities for the candidates
   //
   
-  probabilitySum = 0.0;
-  for (i = 0; i < nChoices; i++) {
-    unsigned char choice = choices[i];
-    float probability = hopsprobabilitydistribution[choice] / 100.0;
-    hopping_assert(choice >= 0 && choice <= 255);
-    probabilitySum += probability;
-  }
+  probabilitySum =
+    hopping_distributionmass(from,to) -
+    hopping_distributionmaskedmass(from,to,excluded);
   
   //
   // Debugs
   //
   
   debugf("hopping_selectfromdistribution probability sum = %f", probabilitySum);
-  hopping_assert(probabilitySum > -0.01);
+  hopping_assert(probabilitySum > 0.0);
   hopping_assert(probabilitySum <  1.01);
   
   //
-  // Normalize the values so that probabilitySum is 1.0
+  // Find the first hop count where the probabilities reach the
+  // given position, normalized so that the probabilities of all
+  // candidates sum to 1.0
   //
   
-  normalizationFactor = 1.0 / probabilitySum;
-  hopping_assert(normalizationFactor >= 1.00);
+  target = probabilityPosition * probabilitySum;
+  low = from;
+  high = to;
+  while (low < high) {
+    unsigned int middle = (low + high) / 2;
+    double probabilityNow =
+      hopping_distributionmass(from,middle) -
+      hopping_distributionmaskedmass(from,middle,excluded);
+    if (probabilityNow >= target) high = middle;
+    else low = middle + 1;
+  }
   
   //
-  // Go through the choices again and pick the one that
-  // first matches the given probability position
+  // The probability does not increase at an excluded hop count, so
+  // the first candidate at or after it is the one that reaches the
+  // position. If there is none (only possible through rounding), take
+  // the last candidate.
   //
-
-  probabilityNow = 0.0;
-  for (i = 0; i < nChoices; i++) {
-    unsigned char choice = choices[i];
-    float probability = normalizationFactor * (hopsprobabilitydistribution[choice] / 100.0);
-    hopping_assert(choice >= 0 && choice <= 255);
-    probabilityNow += probability;
-    if (probabilityNow >= probabilityPosition ||
-	i == nChoices - 1) {
-      debugf("hopping_selectfromdistribution: choosing the %uth choice %u since probability %f reaches expected %f",
-	     i, choice, probabilityNow, probabilityPosition);
-      return(choice);
+  
+  choice = low;
+  while (choice <= to && hopping_ttlinset(excluded,choice)) choice++;
+  if (choice > to) {
+    choice = low;
+    while (hopping_ttlinset(excluded,choice)) {
+      hopping_assert(choice > from);
+      choice--;
     }
   }
   
-  fatalf("hopping_selectfromdistribution: should never get here");
+  debugf("hopping_selectfromdistribution: choosing %u since probability reaches expected %f",
+	 choice, probabilityPosition);
+  return((unsigned char)choice);
 }
 
 //
@@ -2723,20 +6837,9 @@ hopping_selectfromdistribution(double probabilityPosition,
 //
 
 static unsigned int
-hopping_responses() {
-
-  unsigned int count = 0;
-  unsigned int id;
-  
-  for (id = 0; id < HOPPING_MAX_PROBES; id++) {
-    struct hopping_probe* probe = &probes[id];
-    if (probe->used &&
-	probe->responded) {
-      count++;
-    }
-  }
-  
-  return(count);
+hopping_responses(struct hopping_destination* destination) {
+  hopping_assert(destination != 0);
+  return(destination->nResponses);
 }
 
 //
@@ -2744,21 +6847,9 @@ hopping_responses() {
 //
 
 static unsigned int
-hopping_replyresponses() {
-
-  unsigned int count = 0;
-  unsigned int id;
-  
-  for (id = 0; id < HOPPING_MAX_PROBES; id++) {
-    struct hopping_probe* probe = &probes[id];
-    if (probe->used &&
-	probe->responded &&
-	probe->responseType == hopping_responseType_echoResponse) {
-      count++;
-    }
-  }
-  
-  return(count);
+hopping_replyresponses(struct hopping_destination* destination) {
+  hopping_assert(destination != 0);
+  return(destination->nReplyResponses);
 }
 
 //
@@ -2766,43 +6857,19 @@ hopping_replyresponses() {
 //
 
 static unsigned int
-hopping_timeexceededresponses() {
-
-  unsigned int count = 0;
-  unsigned int id;
-  
-  for (id = 0; id < HOPPING_MAX_PROBES; id++) {
-    struct hopping_probe* probe = &probes[id];
-    if (probe->used &&
-	probe->responded &&
-	probe->responseType == hopping_responseType_timeExceeded) {
-      count++;
-    }
-  }
-  
-  return(count);
+hopping_timeexceededresponses(struct hopping_destination* destination) {
+  hopping_assert(destination != 0);
+  return(destination->nTimeExceededResponses);
 }
 
-//
-// See if there were any unreachable errors
-//
-
-static unsigned int
-hopping_unreachableresponses() {
-
-  unsigned int count = 0;
-  unsigned int id;
-  
-  for (id = 0; id < HOPPING_MAX_PROBES; id++) {
-    struct hopping_probe* probe = &probes[id];
-    if (probe->used &&
-	probe->responded &&
-	probe->responseType == hopping_responseType_destinationUnreachable) {
-      count++;
-    }
-  }
-  
-  return(count);
+//
+// See if there were any unreachable errors
+//
+
+static unsigned int
+hopping_unreachableresponses(struct hopping_destination* destination) {
+  hopping_assert(destination != 0);
+  return(destination->nUnreachableResponses);
 }
 
 //
@@ -2810,21 +6877,9 @@ hopping_unreachableresponses() {
 //
 
 static unsigned int
-hopping_waitingforresponses() {
-
-  unsigned int count = 0;
-  unsigned int id;
-  
-  for (id = 0; id < HOPPING_MAX_PROBES; id++) {
-    struct hopping_probe* probe = &probes[id];
-    if (probe->used &&
-	!probe->responded &&
-	probe->responseType != hopping_responseType_noResponse) {
-      count++;
-    }
-  }
-  
-  return(count);
+hopping_waitingforresponses(struct hopping_destination* destination) {
+  hopping_assert(destination != 0);
+  return(destination->nWaitingResponses);
 }
 
 //
@@ -2833,15 +6888,15 @@ hopping_waitingforresponses() {
 //
 
 static void
-hopping_reportBriefConclusion() {
-  if (hopsMinInclusive == hopsMaxInclusive) {
-    printf(" [%u hops away]", hopsMinInclusive);
-  } else if (hopsMinInclusive <= 1 && hopsMaxInclusive >= maxTtl) {
+hopping_reportBriefConclusion(struct hopping_destination* destination) {
+  if (destination->hopsMinInclusive == destination->hopsMaxInclusive) {
+    printf(" [%u hops away]", destination->hopsMinInclusive);
+  } else if (destination->hopsMinInclusive <= 1 && destination->hopsMaxInclusive >= maxTtl) {
     printf(" [unknown hops away]");
   } else {
     printf(" [%u.. %u hops away]",
-	   hopsMinInclusive,
-	   hopsMaxInclusive);
+	   destination->hopsMinInclusive,
+	   destination->hopsMaxInclusive);
   }
 }
 
@@ -2851,14 +6906,13 @@ hopping_reportBriefConclusion() {
 //
 
 static void
-hopping_reportBriefProbeStatus() {
-  unsigned int id;
+hopping_reportBriefProbeStatus(struct hopping_destination* destination) {
+  struct hopping_probe* probe;
   printf("\n");
-  for (id = 0; id < HOPPING_MAX_PROBES; id++) {
-    struct hopping_probe* probe = &probes[id];
-    if (probe->used) {
-      hopping_reportBriefProbeStatusAux(probe);
-    }
+  for (probe = destination->probeList;
+       probe != 0;
+       probe = hopping_probestats(probe)->destinationNext) {
+    hopping_reportBriefProbeStatusAux(probe);
   }
 }
 
@@ -2872,6 +6926,7 @@ hopping_responseTypeToString(enum hopping_responseType rt) {
   case hopping_responseType_timeExceeded:		return("time exceeded");
   case hopping_responseType_retransmissionConsidered:	return("retransmission considered");
   case hopping_responseType_noResponse:			return("no response");
+  case hopping_responseType_cancelled:			return("cancelled");
   default:
     fatalf("should not get here");
   }
@@ -2885,56 +6940,75 @@ hopping_responseTypeToString(enum hopping_responseType rt) {
 static void
 hopping_reportBriefProbeStatusAux(struct hopping_probe* probe) {
   
+  struct hopping_probestats* stats = hopping_probestats(probe);
+  struct timeval deadline;
   struct timeval now;
   hopping_getcurrenttime(&now);
+  hopping_timer_ticktotime(probe->deadline,&deadline);
   
   printf("  probe id #%u ttl %u: %s",
 	 probe->id,
 	 probe->hops,
 	 hopping_responseTypeToString(probe->responseType));
   printf(" ");
-  hopping_reportrelativetime(&probe->sentTime,&now,"sent","ago");
-  if (!hopping_timeisless(&probe->initialTimeout,&now)) {
+  hopping_reportrelativetime(&stats->sentTime,&now,"sent","ago");
+  if (!hopping_timeisless(&deadline,&now)) {
     printf(" ");
-    hopping_reportrelativetime(&now,&probe->initialTimeout,"timeout","from now");
+    hopping_reportrelativetime(&now,&deadline,"timeout","from now");
   }
-  if (probe->newProbeSentInsteadOfRetransmission != 0) {
-    printf(" (probe #%u sent instead of retransmit)", probe->newProbeSentInsteadOfRetransmission->id);
+  if (stats->newProbeSentInsteadOfRetransmission != 0) {
+    printf(" (probe #%u sent instead of retransmit)", stats->newProbeSentInsteadOfRetransmission->id);
   }
   printf("\n");
 }
 
 //
 // Output a conclusion (as much as we know) from the
-// probing process
+// probing process, without the line end
 //
 
 static void
-hopping_reportConclusion() {
+hopping_reportConclusionAux(struct hopping_destination* destination) {
   
-  unsigned int repl = hopping_replyresponses();
-  unsigned int exc = hopping_timeexceededresponses();
-  unsigned int unreach = hopping_unreachableresponses();
-  const char* testDestinationAddressString = hopping_addrtostring(&testDestinationAddress.sin_addr);
+  unsigned int repl = hopping_replyresponses(destination);
+  unsigned int exc = hopping_timeexceededresponses(destination);
+  unsigned int unreach = hopping_unreachableresponses(destination);
+  const char* destinationAddressString = hopping_addrtostring(&destination->address.sin_addr);
+  unsigned char estimate = 0;
+  double confidence = 0.0;
+  int estimated = 0;
 
   if (!machineReadable) {
-    printf("%s (%s) is ", testDestination, testDestinationAddressString);
+    printf("%s (%s) is ", destination->name, destinationAddressString);
   }
   
-  if (hopsMinInclusive == hopsMaxInclusive) {
-    printf("%u", hopsMinInclusive);
-  } else if (hopsMinInclusive <= 1 && hopsMaxInclusive >= maxTtl) {
-    printf("unknown");
+  if (destination->hopsMinInclusive == destination->hopsMaxInclusive) {
+    printf("%u", destination->hopsMinInclusive);
   } else {
-    if (machineReadable) {
+    
+    //
+    // Give the range, and when a deadline has cut the search short,
+    // the most likely hop count within it if there is one
+    //
+    
+    if (deadlineMs > 0 && !machineReadable) {
+      estimated = hopping_estimate(destination,&estimate,&confidence);
+    }
+    if (destination->hopsMinInclusive <= 1 && destination->hopsMaxInclusive >= maxTtl) {
+      printf("unknown");
+    } else if (machineReadable) {
       printf("%u-%u",
-	     hopsMinInclusive,
-	     hopsMaxInclusive);
+	     destination->hopsMinInclusive,
+	     destination->hopsMaxInclusive);
     } else {
       printf("between %u and %u",
-	     hopsMinInclusive,
-	     hopsMaxInclusive);
+	     destination->hopsMinInclusive,
+	     destination->hopsMaxInclusive);
     }
+    if (estimated) {
+      printf(" (%.0f%% likely %u)", confidence * 100.0, estimate);
+    }
+    
   }
   
   if (machineReadable) {
@@ -2970,28 +7044,48 @@ hopping_reportConclusion() {
       printf(", not sure if it is reachable as we got no ICMPs back at all");
   }
   
-  printf("\n");
-  
 }
 
 //
-// Count the number of probes sent
+// In machine readable form, the estimate of a range cut short by a
+// deadline is a separate field at the end of the line, so that the
+// fields before it stay the same
 //
 
-static unsigned int
-hopping_count_probes_sent() {
-
-  unsigned int count = 0;
-  hopping_idtype id;
+static void
+hopping_reportConclusionEstimate(struct hopping_destination* destination) {
   
-  for (id = 0; id < HOPPING_MAX_PROBES; id++) {
-    struct hopping_probe* probe = &probes[id];
-    if (probe->used) {
-      count++;
-    }
+  unsigned char estimate;
+  double confidence;
+  
+  if (machineReadable &&
+      deadlineMs > 0 &&
+      destination->hopsMinInclusive != destination->hopsMaxInclusive &&
+      hopping_estimate(destination,&estimate,&confidence)) {
+    printf(":%u/%.2f", estimate, confidence);
   }
+}
 
-  return(count);
+//
+// Output a conclusion (as much as we know) from the
+// probing process
+//
+
+static void
+hopping_reportConclusion(struct hopping_destination* destination) {
+  hopping_reportConclusionAux(destination);
+  hopping_reportConclusionEstimate(destination);
+  printf("\n");
+}
+
+//
+// Count the number of probes sent
+//
+
+static unsigned int
+hopping_count_probes_sent(struct hopping_destination* destination) {
+  hopping_assert(destination != 0);
+  return(destination->nProbes);
 }
   
 //
@@ -2999,11 +7093,11 @@ hopping_count_probes_sent() {
 //
 
 static void
-hopping_reportStatsBrief() {
+hopping_reportStatsBrief(struct hopping_destination* destination) {
   if (machineReadable) {
-      printf("%u\n", hopping_count_probes_sent());
+      printf("%u\n", hopping_count_probes_sent(destination));
   } else  {
-      printf("%u probes sent\n", hopping_count_probes_sent());
+      printf("%u probes sent\n", hopping_count_probes_sent(destination));
   }
 }
 
@@ -3012,9 +7106,9 @@ hopping_reportStatsBrief() {
 //
 
 static void
-hopping_reportStatsFull() {
+hopping_reportStatsFull(struct hopping_destination* destination) {
   
-  unsigned int nProbes = hopping_count_probes_sent();
+  unsigned int nProbes = hopping_count_probes_sent(destination);
   unsigned int nRetransmissions = 0;
   unsigned int nResponses = 0;
   unsigned int nEchoReplies = 0;
@@ -3023,92 +7117,105 @@ hopping_reportStatsFull() {
   unsigned int nTimeExceededs = 0;
   unsigned int nNoResponses = 0;
   unsigned int nNoResponseTimeouts = 0;
+  unsigned int nCancelled = 0;
   unsigned int nDuplicateResponses = 0;
+  unsigned int nKernelTimedResponses = 0;
   unsigned int probeBytes = 0;
   unsigned int responseBytes = 0;
   unsigned int hopsused[256];
-  unsigned int id;
+  struct hopping_probe* probe;
+  struct hopping_probestats* stats;
   unsigned long shortestDelay = 0xffffffff;
   unsigned long longestDelay = 0;
+  struct timeval lastResponseTime = destination->startTime;
   unsigned int ttl;
+  unsigned int band;
   int seenttl;
   
   memset(hopsused,0,sizeof(hopsused));
-  for (id = 0; id < HOPPING_MAX_PROBES; id++) {
-    struct hopping_probe* probe = &probes[id];
-    if (probe->used) {
+  for (probe = destination->probeList;
+       probe != 0;
+       probe = stats->destinationNext) {
+
+    //
+    // Basic statistics: number of probes, bytes, etc.
+    //
+    
+    stats = hopping_probestats(probe);
+    hopsused[probe->hops]++;
+    probeBytes += stats->probeLength;
+
+    //
+    // Count retransmissions
+    //
+    
+    if (stats->previousTransmission != 0) {
+      nRetransmissions++;
+    }
 
+    //
+    // Look at the possible responses
+    //
+    
+    if (probe->responded) {
+      
       //
-      // Basic statistics: number of probes, bytes, etc.
+      // Basic response statistics
       //
       
-      hopsused[probe->hops]++;
-      probeBytes += probe->probeLength;
-
+      nResponses++;
+      responseBytes += stats->responseLength;
+      nDuplicateResponses += stats->duplicateResponses;
+      
       //
-      // Count retransmissions
+      // Calculate response timings
       //
       
-      if (probe->previousTransmission != 0) {
-	nRetransmissions++;
-      }
+      if (stats->delayUSecs < shortestDelay) shortestDelay = stats->delayUSecs; 
+      if (stats->delayUSecs > longestDelay) longestDelay = stats->delayUSecs;
+      if (stats->kernelSentTime && stats->kernelResponseTime) nKernelTimedResponses++;
+      if (hopping_timeisless(&lastResponseTime,&stats->responseTime)) lastResponseTime = stats->responseTime;
 
       //
-      // Look at the possible responses
+      // Look at the response types
       //
       
-      if (probe->responded) {
-	
-	//
-	// Basic response statistics
-	//
-	
-	nResponses++;
-	responseBytes += probe->responseLength;
-	nDuplicateResponses += probe->duplicateResponses;
-	
-	//
-	// Calculate response timings
-	//
-	
-	if (probe->delayUSecs < shortestDelay) shortestDelay = probe->delayUSecs; 
-	if (probe->delayUSecs > longestDelay) longestDelay = probe->delayUSecs;
+      switch (probe->responseType) {
+      case hopping_responseType_echoResponse:
+	nEchoReplies++;
+	break;
+      case hopping_responseType_destinationUnreachable:
+	nDestinationUnreachables++;
+	break;
+      case hopping_responseType_redirect:
+	nRedirects++;
+	break;
+      case hopping_responseType_timeExceeded:
+	nTimeExceededs++;
+	break;
+      case hopping_responseType_stillWaiting:
+      case hopping_responseType_retransmissionConsidered:
+      case hopping_responseType_noResponse:
+      case hopping_responseType_cancelled:
+	fatalf("should not have this response type");
+	break;
+      default:
+	fatalf("invalid response type");
+      }
+      
+    } else {
 
-	//
-	// Look at the response types
-	//
+      nNoResponses++;
+      if (probe->responseType == hopping_responseType_noResponse) {
 	
-	switch (probe->responseType) {
-	case hopping_responseType_echoResponse:
-	  nEchoReplies++;
-	  break;
-	case hopping_responseType_destinationUnreachable:
-	  nDestinationUnreachables++;
-	  break;
-	case hopping_responseType_redirect:
-	  nRedirects++;
-	  break;
-	case hopping_responseType_timeExceeded:
-	  nTimeExceededs++;
-	  break;
-	case hopping_responseType_stillWaiting:
-	case hopping_responseType_retransmissionConsidered:
-	case hopping_responseType_noResponse:
-	  fatalf("should not have this response type");
-	default:
-	  fatalf("invalid response type");
-	}
+	nNoResponseTimeouts++;
 	
-      } else {
-
-	nNoResponses++;
-	if (probe->responseType == hopping_responseType_noResponse) {
-	  
-	  nNoResponseTimeouts++;
-	  
-	}
+      } else if (probe->responseType == hopping_responseType_cancelled) {
+	
+	nCancelled++;
 	
       }
+      
     }
   }
   
@@ -3117,8 +7224,31 @@ hopping_reportStatsFull() {
   printf("\n");
   printf("%12s    algorithm\n", hopping_algorithm2name(algorithm));
   printf("  %10u    allowed parallel probes\n", parallel);
+  if (hopping_round_inuse()) {
+    printf("  %10u    rounds of parallel probes\n", destination->rounds);
+  }
+  if (speculationBudget > 0) {
+    printf("  %10u    speculative probes sent\n", destination->speculativeProbes);
+  }
+  if (redundancy > 1) {
+    printf("  %10u    redundant copies of probes sent\n", destination->redundantProbes);
+  }
   printf("  %10s    readjust search space based on responses\n", readjust ? "yes" : "no");
   printf("  %10u    probes sent out\n", nProbes);
+  if (algorithm == hopping_algorithms_latency) {
+    printf("%12.4f    expected time until the result (ms), as predicted by the model\n",
+	   hopping_latency_expectedtime(destination) / 1000.0);
+  }
+  printf("%12.4f    time until the last response (ms)\n",
+	 hopping_timediffinusecs(&lastResponseTime,&destination->startTime) / 1000.0);
+  if (algorithm == hopping_algorithms_latency) {
+    struct hopping_latencymodel model;
+    hopping_latency_model(destination,&model);
+    printf("%12.4f    echo reply probability\n", model.echoProbability);
+    printf("%12.4f    echo reply delay (ms)\n", model.echoDelayUSecs / 1000.0);
+    printf("%12.4f    time exceeded probability\n", model.timeExceededProbability);
+    printf("%12.4f    time exceeded delay (ms)\n", model.timeExceededDelayUSecs / 1000.0);
+  }
   if (nProbes > 0) {
     printf("                on TTLs: ");
     seenttl = 0;
@@ -3145,10 +7275,28 @@ hopping_reportStatsFull() {
   if (nResponses > 0) {
     printf("%12.4f    shortest response delay (ms)\n", ((float)shortestDelay / 1000.0));
     printf("%12.4f    longest response delay (ms)\n", ((float)longestDelay / 1000.0));
+    printf("  %10u    responses timed with kernel timestamps\n", nKernelTimedResponses);
+  }
+  if (destination->rtt.samples > 0) {
+    printf("%12.4f    smoothed round-trip time (ms)\n", destination->rtt.srttUSecs / 1000.0);
+    printf("%12.4f    round-trip time variation (ms)\n", destination->rtt.rttvarUSecs / 1000.0);
+    printf("%12.4f    retransmission timeout (ms)\n", hopping_rtt_timeout(&destination->rtt) / 1000.0);
+    for (band = 0; band < HOPPING_RTT_BANDS; band++) {
+      struct hopping_rttestimator* estimator = &destination->rttBands[band];
+      if (estimator->samples == 0) continue;
+      printf("                on TTLs %u..%u: %u samples, srtt %.4f ms, rttvar %.4f ms, timeout %.4f ms\n",
+	     band * HOPPING_RTT_BAND_WIDTH,
+	     band * HOPPING_RTT_BAND_WIDTH + HOPPING_RTT_BAND_WIDTH - 1,
+	     estimator->samples,
+	     estimator->srttUSecs / 1000.0,
+	     estimator->rttvarUSecs / 1000.0,
+	     hopping_rtt_timeout(estimator) / 1000.0);
+    }
   }
   printf("  %10u    additional duplicate responses\n", nDuplicateResponses);
   printf("  %10u    probes without responses\n", nNoResponses);
   printf("  %10u    timeouts waiting for probes with a given TTL\n", nNoResponseTimeouts);
+  printf("  %10u    probes cancelled as no longer useful\n", nCancelled);
 }
 
 //
@@ -3156,9 +7304,9 @@ hopping_reportStatsFull() {
 //
 
 static void
-hopping_reportStats() {
-  if (fullStatistics) hopping_reportStatsFull();
-  else if (briefStatistics) hopping_reportStatsBrief();
+hopping_reportStats(struct hopping_destination* destination) {
+  if (fullStatistics) hopping_reportStatsFull(destination);
+  else if (briefStatistics) hopping_reportStatsBrief(destination);
 }
 
 //
@@ -3172,6 +7320,266 @@ hopping_interrupt(int dummy) {
   interrupt = 1;
 }
 
+#ifdef HOPPING_BENCHMARK
+
+//
+// Benchmarks ---------------------------------------------------------------------------
+//
+// Built with "make bench". Measures how fast the in-flight probe
+// table can be scanned and how fast probe timers can be armed and
+// expired, for large batches of probes. For comparison, the scan is
+// also run over a table with the earlier layout, where all the
+// state of a probe was in one structure.
+//
+
+struct hopping_benchmark_oldprobe {
+  int used;
+  hopping_idtype id;
+  struct hopping_destination* destination;
+  struct hopping_probe* destinationNext;
+  unsigned char hops;
+  struct hopping_probe* previousTransmission;
+  struct hopping_probe* nextRetransmission;
+  struct hopping_probe* newProbeSentInsteadOfRetransmission;
+  unsigned int probeLength;
+  struct timeval sentTime;
+  int kernelSentTime;
+  uint32_t transmitKey;
+  struct timeval initialTimeout;
+  unsigned int tries;
+  int timerArmed;
+  unsigned int timerSlot;
+  struct hopping_probe* timerNext;
+  struct hopping_probe* timerPrev;
+  int responded;
+  unsigned int duplicateResponses;
+  unsigned int responseLength;
+  struct timeval responseTime;
+  int kernelResponseTime;
+  unsigned long delayUSecs;
+  enum hopping_responseType responseType;
+};
+
+#define HOPPING_BENCHMARK_VISITS	(50 * 1000 * 1000)
+#define HOPPING_BENCHMARK_SPREAD_TICKS	20000
+
+//
+// Report the rate at which probes were processed
+//
+
+static void
+hopping_benchmark_report(const char* what,
+			 unsigned int nProbes,
+			 size_t probeSize,
+			 unsigned long long visits,
+			 struct timeval* start,
+			 unsigned int result) {
+  
+  struct timeval end;
+  unsigned long long us;
+  
+  hopping_getcurrenttime(&end);
+  us = hopping_timediffinusecs(&end,start);
+  if (us == 0) us = 1;
+  printf("%8u probes  %-22s %4u bytes/probe  %8.1f Mprobes/s  (%u)\n",
+	 nProbes, what, (unsigned int)probeSize,
+	 (double)visits / us, result);
+}
+
+//
+// Run the benchmarks for a table of a given number of probes
+//
+
+static void
+hopping_benchmark_run(unsigned int nProbes) {
+  
+  struct hopping_benchmark_oldprobe* oldProbes;
+  unsigned int rounds = HOPPING_BENCHMARK_VISITS / nProbes;
+  unsigned int round;
+  unsigned int i;
+  unsigned int result;
+  uint32_t nowTick = HOPPING_BENCHMARK_SPREAD_TICKS / 2;
+  struct timeval now;
+  struct timeval start;
+  struct hopping_probe* expired;
+  
+  if (rounds == 0) rounds = 1;
+  maxProbes = nProbes;
+  hopping_initprobes();
+  hopping_assert(probeTableSize >= nProbes);
+  hopping_timer_initialize();
+  oldProbes = (struct hopping_benchmark_oldprobe*)calloc(nProbes,sizeof(*oldProbes));
+  if (oldProbes == 0) fatalf("cannot allocate memory for %u probes", nProbes);
+  
+  //
+  // Fill both tables with the same probes: some have responses,
+  // and the rest have deadlines spread over the next seconds
+  //
+  
+  for (i = 0; i < nProbes; i++) {
+    struct hopping_probe* probe = &probes[i];
+    struct hopping_benchmark_oldprobe* old = &oldProbes[i];
+    probe->used = old->used = 1;
+    probe->id = old->id = i;
+    probe->hops = old->hops = 1 + i % 32;
+    probe->responded = old->responded = (i % 4 == 0);
+    probe->responseType = old->responseType =
+      probe->responded ? hopping_responseType_echoResponse : hopping_responseType_stillWaiting;
+    probe->deadline = rand() % HOPPING_BENCHMARK_SPREAD_TICKS;
+    hopping_timer_ticktotime(probe->deadline,&old->initialTimeout);
+  }
+  hopping_timer_ticktotime(nowTick,&now);
+  
+  //
+  // Scan for waiting probes whose deadline has passed
+  //
+  
+  hopping_getcurrenttime(&start);
+  for (result = 0, round = 0; round < rounds; round++) {
+    for (i = 0; i < nProbes; i++) {
+      struct hopping_probe* probe = &probes[i];
+      result += (probe->used &&
+		 !probe->responded &&
+		 probe->responseType == hopping_responseType_stillWaiting &&
+		 probe->deadline <= nowTick);
+    }
+  }
+  hopping_benchmark_report("hot/cold scan",nProbes,sizeof(struct hopping_probe),
+			   (unsigned long long)rounds * nProbes,&start,result / rounds);
+  
+  hopping_getcurrenttime(&start);
+  for (result = 0, round = 0; round < rounds; round++) {
+    for (i = 0; i < nProbes; i++) {
+      struct hopping_benchmark_oldprobe* old = &oldProbes[i];
+      result += (old->used &&
+		 !old->responded &&
+		 old->responseType == hopping_responseType_stillWaiting &&
+		 !hopping_timeisless(&now,&old->initialTimeout));
+    }
+  }
+  hopping_benchmark_report("single structure scan",nProbes,sizeof(struct hopping_benchmark_oldprobe),
+			   (unsigned long long)rounds * nProbes,&start,result / rounds);
+  
+  //
+  // Arm the timers of all waiting probes, and expire them all
+  //
+  
+  hopping_getcurrenttime(&start);
+  for (result = 0, i = 0; i < nProbes; i++) {
+    if (!probes[i].responded) hopping_timer_arm(&probes[i]);
+  }
+  hopping_timer_ticktotime(HOPPING_BENCHMARK_SPREAD_TICKS,&now);
+  expired = hopping_timer_expire(&now);
+  while (expired != 0) {
+    result++;
+    expired = expired->timerNext;
+  }
+  hopping_benchmark_report("timer arm and expire",nProbes,sizeof(struct hopping_probe),
+			   nProbes,&start,result);
+  
+  free(oldProbes);
+  free(probes);
+  free(probeStats);
+  free(probeGenerations);
+  free(freeSlots);
+}
+
+//
+// Count the probes that binary search needs to find a given hop
+// count, with responses to every probe and no likely candidates
+// first. Simulated, without sending anything.
+//
+
+static unsigned int
+hopping_benchmark_searchprobes(struct hopping_destination* destination,
+			       unsigned char hops) {
+  
+  unsigned int nProbes = 0;
+  
+  memset(destination,0,sizeof(*destination));
+  destination->hopsMinInclusive = 1;
+  destination->hopsMaxInclusive = 255;
+  
+  while (!hopping_searchdone(destination)) {
+    
+    unsigned char ttl = hopping_bestbinarysearchvalue(destination,
+						      destination->hopsMinInclusive,
+						      destination->hopsMaxInclusive,
+						      1);
+    destination->ttlsProbed[ttl / 64] |= (1ULL << (ttl % 64));
+    nProbes++;
+    if (hops <= ttl) destination->hopsMaxInclusive = ttl;
+    else destination->hopsMinInclusive = ttl + 1;
+    
+  }
+  
+  return(nProbes);
+}
+
+//
+// Compare the expected number of probes, over the hop count
+// distribution, for different -tolerance values
+//
+
+static void
+hopping_benchmark_tolerance(void) {
+  
+  struct hopping_destination* destination;
+  double exact = 0.0;
+  unsigned int k;
+  
+  destination = (struct hopping_destination*)calloc(1,sizeof(*destination));
+  if (destination == 0) fatalf("cannot allocate memory for a destination");
+  hopping_initdistribution();
+  
+  for (k = 0; k <= 4; k++) {
+    
+    double expected = 0.0;
+    unsigned int worst = 0;
+    unsigned int h;
+    
+    tolerance = k;
+    for (h = 1; h < 256; h++) {
+      unsigned int n = hopping_benchmark_searchprobes(destination,(unsigned char)h);
+      expected += hopsprobabilitydistribution[h] / 100.0 * n;
+      if (n > worst) worst = n;
+    }
+    if (k == 0) exact = expected;
+    printf("tolerance %u (+-%u hops)  %6.3f probes expected  %3u at most  %5.1f%% fewer than exact\n",
+	   k, k, expected, worst, 100.0 * (exact - expected) / exact);
+    
+  }
+  
+  tolerance = 0;
+  free(destination);
+}
+
+int
+main(int argc,
+     char** argv) {
+  
+  (void)argc;
+  (void)argv;
+  srand(time(0));
+  hopping_benchmark_run(10 * 1000);
+  hopping_benchmark_run(100 * 1000);
+  hopping_benchmark_run(1000 * 1000);
+  hopping_benchmark_tolerance();
+  exit(0);
+}
+
+//
+// In the benchmark build, the main program below is compiled but not
+// run, under another name
+//
+
+int
+hopping_main(int argc,
+	     char** argv);
+#define main hopping_main
+
+#endif
+
 //
 // The main program -----------------------------------------------------------------------
 //
@@ -3274,6 +7682,8 @@ main(int argc,
       debugf("maxProbes set to %u", maxProbes);
       if (maxProbes < 1)
 	fatalf("Cannot set -maxprobes to a value less than 1");
+      if (maxProbes > HOPPING_MAX_PROBES)
+	fatalf("Cannot set -maxprobes to a value greater than %u", HOPPING_MAX_PROBES);
       argc--; argv++;
       
     } else if (strcmp(argv[0],"-maxwait") == 0 && argc > 1 && isdigit(argv[1][0])) {
@@ -3284,6 +7694,21 @@ main(int argc,
 	fatalf("Cannot set -maxwait to a value less than 1");
       argc--; argv++;
       
+    } else if (strcmp(argv[0],"-tolerance") == 0 && argc > 1 && isdigit(argv[1][0])) {
+      
+      tolerance = atoi(argv[1]);
+      if (tolerance > 127) {
+	fatalf("invalid tolerance %u", tolerance);
+      }
+      debugf("tolerance set to %u", tolerance);
+      argc--; argv++;
+      
+    } else if (strcmp(argv[0],"-deadline") == 0 && argc > 1 && isdigit(argv[1][0])) {
+      
+      deadlineMs = atoi(argv[1]);
+      debugf("deadlineMs set to %u", deadlineMs);
+      argc--; argv++;
+      
     } else if (strcmp(argv[0],"-maxtries") == 0 && argc > 1 && isdigit(argv[1][0])) {
       
       maxTries = atoi(argv[1]);
@@ -3307,6 +7732,20 @@ main(int argc,
       debugf("probePacing set to %u", probePacing);
       argc--; argv++;
 
+    } else if (strcmp(argv[0],"-targets-file") == 0 && argc > 1) {
+
+      targetsFile = argv[1];
+      argc--; argv++;
+
+    } else if (strcmp(argv[0],"-concurrent-destinations") == 0 && argc > 1 && isdigit(argv[1][0])) {
+
+      concurrentDestinations = atoi(argv[1]);
+      if (concurrentDestinations < 1) {
+	fatalf("Cannot set -concurrent-destinations to a value less than 1");
+      }
+      debugf("concurrentDestinations set to %u", concurrentDestinations);
+      argc--; argv++;
+
     } else if (strcmp(argv[0],"-no-parallel") == 0) {
       
       parallel = 1;
@@ -3321,6 +7760,12 @@ main(int argc,
 	algorithm = hopping_algorithms_reversesequential;
       } else if (strcmp(argv[1],"binarysearch") == 0) {
 	algorithm = hopping_algorithms_binarysearch;
+      } else if (strcmp(argv[1],"bayes") == 0) {
+	algorithm = hopping_algorithms_bayes;
+      } else if (strcmp(argv[1],"optimal") == 0) {
+	algorithm = hopping_algorithms_optimal;
+      } else if (strcmp(argv[1],"latency") == 0) {
+	algorithm = hopping_algorithms_latency;
       } else {
 	fatalf("invalid algorithm value %s (expecting %s)",
 	       argv[1], hopping_algorithms_string);
@@ -3336,6 +7781,39 @@ main(int argc,
 
       likelyCandidates = 0;
 
+    } else if (strcmp(argv[0],"-fingerprint") == 0) {
+
+      fingerprint = 1;
+      
+    } else if (strcmp(argv[0],"-no-fingerprint") == 0) {
+
+      fingerprint = 0;
+
+    } else if (strcmp(argv[0],"-speculate") == 0 && argc > 1 && isdigit(argv[1][0])) {
+
+      speculationBudget = atoi(argv[1]);
+      debugf("speculation budget set to %u", speculationBudget);
+      argc--; argv++;
+      
+    } else if (strcmp(argv[0],"-no-speculate") == 0) {
+
+      speculationBudget = 0;
+
+    } else if (strcmp(argv[0],"-redundancy") == 0 && argc > 1 && isdigit(argv[1][0])) {
+
+      redundancy = atoi(argv[1]);
+      if (redundancy < 1 || redundancy > HOPPING_MAX_REDUNDANCY) {
+	fatalf("invalid redundancy, expecting 1 to %u", HOPPING_MAX_REDUNDANCY);
+      }
+      debugf("redundancy set to %u", redundancy);
+      argc--; argv++;
+      
+    } else if (strcmp(argv[0],"-redundancy-stagger") == 0 && argc > 1 && isdigit(argv[1][0])) {
+
+      redundancyStagger = atoi(argv[1]);
+      debugf("redundancyStagger set to %u", redundancyStagger);
+      argc--; argv++;
+
     } else if (strcmp(argv[0],"-probabilistic-distribution") == 0) {
 
       probabilisticDistribution = 1;
@@ -3344,6 +7822,43 @@ main(int argc,
 
       probabilisticDistribution = 0;
 
+    } else if (strcmp(argv[0],"-bayes-confidence") == 0 && argc > 1 && isdigit(argv[1][0])) {
+
+      bayesConfidence = atof(argv[1]);
+      if (bayesConfidence <= 0.0 || bayesConfidence > 1.0) {
+	fatalf("Cannot set -bayes-confidence outside 0..1");
+      }
+      debugf("bayesConfidence set to %f", bayesConfidence);
+      argc--; argv++;
+
+    } else if (strcmp(argv[0],"-bayes-silence") == 0 && argc > 1 && isdigit(argv[1][0])) {
+
+      bayesSilence = atof(argv[1]);
+      if (bayesSilence < 0.0 || bayesSilence >= 1.0) {
+	fatalf("Cannot set -bayes-silence outside 0..1");
+      }
+      debugf("bayesSilence set to %f", bayesSilence);
+      argc--; argv++;
+
+    } else if (strcmp(argv[0],"-optimal-cache") == 0 && argc > 1) {
+
+      optimalCacheFile = argv[1];
+      argc--; argv++;
+
+    } else if (strcmp(argv[0],"-distribution-file") == 0 && argc > 1) {
+
+      distributionFile = argv[1];
+      argc--; argv++;
+
+    } else if (strcmp(argv[0],"-distribution-decay") == 0 && argc > 1 && isdigit(argv[1][0])) {
+
+      distributionDecay = atof(argv[1]);
+      if (distributionDecay <= 0.0 || distributionDecay >= 1.0) {
+	fatalf("Cannot set -distribution-decay outside 0..1");
+      }
+      debugf("distributionDecay set to %f", distributionDecay);
+      argc--; argv++;
+
     } else if (strcmp(argv[0],"-retransmit-priority") == 0) {
       
       preferRetransmissionsOverNewProbes = 1;
@@ -3360,6 +7875,14 @@ main(int argc,
 
       readjust = 0;
       
+    } else if (strcmp(argv[0],"-kernel-timestamps") == 0) {
+
+      kernelTimestamps = 1;
+      
+    } else if (strcmp(argv[0],"-no-kernel-timestamps") == 0) {
+
+      kernelTimestamps = 0;
+      
     } else if (strcmp(argv[0],"-interface") == 0 && argc > 1) {
 
       interface = argv[1];
@@ -3391,20 +7914,45 @@ main(int argc,
     
   }
   
+  //
+  // In batch mode, open the targets file. Per-probe progress
+  // reports would be interleaved between destinations, so
+  // they are not shown in batch mode.
+  //
+  
+  if (targetsFile != 0) {
+    
+    if (testDestination != 0) {
+      fatalf("cannot specify both a destination and -targets-file");
+    }
+    if (strcmp(targetsFile,"-") == 0) {
+      targetsInput = stdin;
+    } else if ((targetsInput = fopen(targetsFile,"r")) == 0) {
+      fatalf("cannot open targets file %s", targetsFile);
+    }
+    progress = 0;
+    progressDetailed = 0;
+    progressDetailedProbeStatus = 0;
+    
+  } else if (testDestination == 0) {
+    
+    testDestination = HOPPING_DEFAULT_DESTINATION;
+    
+  }
+  
   signal(SIGINT, hopping_interrupt);
 
   hopping_initdistribution();
-  hopping_getcurrenttime(&startTime);
+  if (algorithm == hopping_algorithms_optimal) {
+    hopping_optimal_initialize();
+  }
   
   hopping_runtest(startTtl,
-		  interface,
-		  testDestination);
+		  interface);
   
-  if (conclusion) {
-    hopping_reportConclusion();
+  if (distributionFile != 0) {
+    hopping_savedistribution(distributionFile);
   }
   
-  hopping_reportStats();
-  
   exit(0);
 }